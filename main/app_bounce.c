@@ -7,7 +7,6 @@
 #include <freertos/task.h>
 
 #include <esp_log.h>
-#include <esp_timer.h>
 
 #include "network.h"
 
@@ -15,18 +14,16 @@
 
 #define APP_BOUNCE_MAGIC 0x0A001B11
 
-void app_bounce_timer_cb(void* param);
+void app_bounce_recv(const net_msg_t* msgs, int count, void* ctx);
 
 static const char* TAG = "app_bounce";
 
 struct {
     uint8_t            node_id;
-    uint16_t           cycle_time_ms;
-    esp_timer_handle_t timer;
 } AppState = {};
 
 
-void app_bounce_init(uint8_t node_id, uint16_t cycle) {
+void app_bounce_init(uint8_t node_id) {
     // memset(&AppState, 0, sizeof(AppState));
     if (AppState.node_id != 0) {
         ESP_LOGE(TAG, "Error: app_bounce already initialized.");
@@ -37,29 +34,10 @@ void app_bounce_init(uint8_t node_id, uint16_t cycle) {
         ESP_LOGE(TAG, "Failed to initialize app_bounce, invalid node-id.");
         return;
     }
-    if (cycle < 500) {
-        ESP_LOGE(TAG, "Failed to initialize app_bounce, invalid cycle time (must be >= 500).");
-    }
 
     AppState.node_id = node_id;
-    AppState.cycle_time_ms = cycle;
-
-    esp_timer_create_args_t timer_init = {};
-    timer_init.callback = app_bounce_timer_cb;
-    timer_init.dispatch_method = ESP_TIMER_TASK;
-    timer_init.name = "app_bounce_timer";
-    timer_init.skip_unhandled_events = 1;
 
-    if (esp_timer_create(&timer_init, &AppState.timer) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize app_bounce, could not create timer.");
-        return;
-    }
-
-    net_register_app(APP_BOUNCE_ID);
-
-    uint64_t c = AppState.cycle_time_ms;
-    c *= 1000;
-    esp_timer_start_periodic(AppState.timer, c);
+    net_register_app_handler(APP_BOUNCE_ID, app_bounce_recv, NULL);
     ESP_LOGI(TAG, "Initialized app_bounce.");
 }
 
@@ -117,31 +95,31 @@ void app_bounce_add_message_down(const char* message, uint32_t life) {
     net_send_down(&head, (const uint8_t*)&data);
 }
 
-void app_bounce_timer_cb(void* param) {
-    app_header_t head = {};
-    bounce_packet_t data = {};
-    while (net_receive(APP_BOUNCE_ID, &head, (uint8_t*)&data, 0) == 0) {
-        if (data.magic == APP_BOUNCE_MAGIC) {
-            ESP_LOGI(TAG, "[node: 0x%02X i: %d] %s", data.node_id, data.counter, data.buffer);
-
-            data.counter++;
-            data.node_id = AppState.node_id;
-
-            if (data.counter <= data.life) {
-                // Leverage the hidden functionality -- check whether packet came
-                //    from up-stream or down.
-                // NOTE: This behaviour may need to be re-implemented if network
-                //    layer implementation changes!  This is a bit of a no-no.
-                if (head.reserved[0] == 0x01) {
-                    net_send_up(&head, (const uint8_t*)&data);
-                }
-                else if (head.reserved[0] == 0x00) {
-                    net_send_down(&head, (const uint8_t*)&data);
-                }
-            }
+void app_bounce_recv(const net_msg_t* msgs, int count, void* ctx) {
+    for (int i = 0; i < count; ++i) {
+        app_header_t head = *msgs[i].head;
+        bounce_packet_t data = {};
+        memcpy(&data, msgs[i].data, (head.len < sizeof(bounce_packet_t) ? head.len : sizeof(bounce_packet_t)));
+        if (data.magic != APP_BOUNCE_MAGIC) {
+            continue;
         }
 
-        memset(&head, 0, sizeof(app_header_t));
-        memset(&data, 0, sizeof(bounce_packet_t));
+        ESP_LOGI(TAG, "[node: 0x%02X i: %d] %s", data.node_id, data.counter, data.buffer);
+
+        data.counter++;
+        data.node_id = AppState.node_id;
+
+        if (data.counter <= data.life) {
+            // Leverage the hidden functionality -- check whether packet came
+            //    from up-stream or down.
+            // NOTE: This behaviour may need to be re-implemented if network
+            //    layer implementation changes!  This is a bit of a no-no.
+            if (head.reserved[0] == 0x01) {
+                net_send_up(&head, (const uint8_t*)&data);
+            }
+            else if (head.reserved[0] == 0x00) {
+                net_send_down(&head, (const uint8_t*)&data);
+            }
+        }
     }
 }
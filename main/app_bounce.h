@@ -3,9 +3,8 @@
 
 /*
 * Bounce application sends bounce packets it receives from downstream back
-*  down, and bounce packets it receives from upstream back up.
-* A control value, 'cycle', describes the period (in milliseconds) between
-*  performing bounces for this application.
+*  down, and bounce packets it receives from upstream back up, as soon as
+*  they arrive.
 */
 
 #define APP_BOUNCE_ID 10
@@ -20,6 +19,6 @@ typedef struct {
 } bounce_packet_t;
 
 
-void app_bounce_init(uint8_t node_id, uint16_t cycle);
+void app_bounce_init(uint8_t node_id);
 void app_bounce_add_message_up(const char* message, uint32_t life);
 void app_bounce_add_message_down(const char* message, uint32_t life);
@@ -5,6 +5,7 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 
 #include <esp_log.h>
@@ -24,6 +25,7 @@
 
 static const char* TAG = "app_sensor";
 
+void app_sensor_recv(const net_msg_t* msgs, int count, void* ctx);
 void push_cache(const sensor_packet_t* entry);
 void update_period();
 void process_cache(sensor_packet_t* out, const dht_data_t* local);
@@ -46,6 +48,7 @@ struct {
 	esp_timer_handle_t		timer;
 	EventGroupHandle_t		events;
 	TaskHandle_t			srv_sensor;
+	SemaphoreHandle_t		lock;		// Guards the cache, filled by app_sensor_recv(..).
 } state;
 
 void app_sensor_timer_cb(void* param) {
@@ -64,37 +67,34 @@ void app_sensor_task(void* param) {
 
 		dht_data_t			local = {};
 		app_header_t		head = {};
-		uint8_t				data[128];
 		sensor_packet_t		remote = {};
 
-		memset(data, 0, 128);
-		while (!net_receive(APP_SENSOR_ID, &head, data, 0)) {
-			if (head.len != sizeof(sensor_packet_t)) {
-				continue;
-			}
-			memcpy(&remote, data, sizeof(sensor_packet_t));
-			memset(data, 0, 128);
-
-			if (!check_magic(&remote)) {
-				continue;
-			}
-
-			push_cache(&remote);
-		}
+		// The sensor may take a while, read it before locking out app_sensor_recv(..).
+		int valid = dht_read(&local);
 
+		xSemaphoreTake(state.lock, portMAX_DELAY);
 		update_period();
 		init_packet(&remote);
+		process_cache(&remote, (valid == 0 ? &local : NULL));
+		xSemaphoreGive(state.lock);
+
 		memset(&head, 0, sizeof(app_header_t));
 		head.type = APP_SENSOR_ID;
 		head.len = sizeof(sensor_packet_t);
 
-		int valid = dht_read(&local);
-		process_cache(&remote, (valid == 0 ? &local : NULL));
-		net_send_up(&head, (const uint8_t*)&remote);
+		// The cache is already folded into this packet, so wait for credit rather
+		//  than lose it; at most half a period, to keep the next reading on time.
+		int result = net_send_up_wait(&head, (const uint8_t*)&remote, (state.period * FACTOR_PERIOD) / 2000);
+		if (result != 0) {
+			ESP_LOGW(TAG, "Failed to send sensor packet (%d).", result);
+		}
 
 		// debug_print(&remote);
 
 		t_delta = esp_timer_get_time() - t_start;
+		if (t_delta > state.period * FACTOR_PERIOD) {
+			t_delta = state.period * FACTOR_PERIOD;
+		}
 
 		esp_timer_start_once(state.timer, (state.period * FACTOR_PERIOD) - t_delta);
 	}
@@ -119,6 +119,12 @@ void app_sensor_init(uint8_t node_id) {
 		return;
 	}
 
+	state.lock = xSemaphoreCreateMutex();
+	if (!state.lock) {
+		ESP_LOGE(TAG, "Failed to create application cache mutex.");
+		return;
+	}
+
 	xTaskCreatePinnedToCore(
 		app_sensor_task,
 		"srv_sensor",
@@ -134,11 +140,26 @@ void app_sensor_init(uint8_t node_id) {
 
 	memset(&(state.cache), 0, sizeof(state.cache));
 
-	net_register_app(APP_SENSOR_ID);
+	net_register_app_handler(APP_SENSOR_ID, app_sensor_recv, NULL);
 
 	esp_timer_start_once(state.timer, state.period * FACTOR_PERIOD);
 }
 
+/*
+* Network handler -- caches the packets arriving from down-stream until the
+*  next update.
+*/
+void app_sensor_recv(const net_msg_t* msgs, int count, void* ctx) {
+	xSemaphoreTake(state.lock, portMAX_DELAY);
+	for (int i = 0; i < count; ++i) {
+		const sensor_packet_t* pkt = (const sensor_packet_t*)msgs[i].data;
+		if (msgs[i].head->len == sizeof(sensor_packet_t) && check_magic(pkt)) {
+			push_cache(pkt);
+		}
+	}
+	xSemaphoreGive(state.lock);
+}
+
 /*
 * This method works through the cache of packets from down-stream.  It
 *  combines them with a local sensor reading (if available) and fills the
@@ -15,10 +15,12 @@
 #include "esp_now.h"
 #include "esp_netif.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "network.h"
 #include "collatz.h"
 #include "rl_int.h"
+#include "serial_out.h"
 
 /******************************************************************/
 
@@ -53,6 +55,7 @@ static int led_count = 0;
 #define BLOCK_DONE  2  // reported as completed
 #define BLOCK_MASK  3  // to extract state of computation
 
+#define BLOCK_RANGE 4  // verification range announcement (collatz_range_t)
 #define BLOCK_UP    8  // for communication, message heading up
 
 /*
@@ -69,15 +72,34 @@ typedef struct
     char     magic[4];    /* Unique identifier, "f3n1" (no terminator) */
     int16_t  report_type; /* BLOCK_TAKEN or BLOCK_DONE                 */
     int16_t  block_id;    /* the block we work(ed) on, or -1           */
+    uint16_t session;     /* verification range the report belongs to  */
+    uint8_t  origin;      /* node-id of the reporter, 0 if unknown     */
+    uint8_t  padding;
     bigint_t base;        /* blocks done -- offset, and ODD!           */
 } collatz_t;
 
+/*
+ *  Verification range announcement: everybody restarts from 'start'
+ *  and stops once the integer frame has passed 'end'
+ */
+typedef struct
+{
+    char     magic[4];    /* "f3n1" as above                           */
+    int16_t  report_type; /* BLOCK_RANGE                               */
+    uint16_t session;     /* newer session replaces the current one    */
+    bigint_t start;       /* the first base offset, ODD                */
+    bigint_t end;         /* the last integer to verify                */
+} collatz_range_t;
+
 /* These variables are behind the semaphore */
 static SemaphoreHandle_t mutex = NULL;
 static collatz_t         job;             // the current frame 
 static collatz_t         job2;            // for processing incoming reports
 static uint8_t           block[ BLOCKS ]; // 
 static int               collatz_root;
+static collatz_range_t   range;           // the current verification range
+static int               range_bounded;   // zero => the frame just keeps going
+static int64_t           range_t0;        // non-zero on the node that issued the range
 
 /*
  *  HW random numbers
@@ -89,10 +111,29 @@ uint32_t hw_random32( void ) {
     return (uint32_t)READ_PERI_REG( DR_REG_RNG_BASE );
 }
 
+/*
+ *  Number of blocks in the frame that still intersect the verification range
+ *  - BLOCKS if the range is unbounded, 0 once the whole range is done
+ *  - Semaphore MUST be acquired before calling this function
+ */
+int range_blocks(void)
+{
+    bigint_t b;
+    int      i;
+
+    if ( !range_bounded )
+        return BLOCKS;
+    rl_set( &b, &job.base );
+    for(i=0; i<BLOCKS && rl_greater( &range.end, &b ); i++)
+        rl_add( &b, BLOCKSIZE );
+    return i;
+}
+
 /*
  *  This function selects the next block in random
  *  - priority is on the free blocks
  *  - non-uniform selection prefers earlier blocks (integer frame moves earlier)
+ *  - returns -1 if the verification range has been completed
  *  - Acquires the semaphore itself
  */
 int pick_block(void) 
@@ -101,13 +142,19 @@ int pick_block(void)
     
     xSemaphoreTake( mutex, portMAX_DELAY );   // we deal with block[], so lock needed
     
-    for(uint32_t i=0; i<BLOCKS; i++)          // no overflow if BLOCKS <= 92681
+    int limit = range_blocks();
+    if ( !limit )
+    {
+        xSemaphoreGive( mutex );
+        return -1;
+    }
+    for(uint32_t i=0; i<limit; i++)           // no overflow if BLOCKS <= 92681
         if ( block[i]==BLOCK_FREE )
             mass += BLOCKS-i;
     if ( mass )
     {
         uint32_t rnd = hw_random32() % mass;  // ok, assuming that prng is good and mass << 2^32
-        for(int i=0; i<BLOCKS; i++)
+        for(int i=0; i<limit; i++)
         {
             if ( block[i]!=BLOCK_FREE )
                 continue;
@@ -172,14 +219,36 @@ void log_report_blocks(void)
     ESP_LOGI( COMP, "  blocks: [%s]", buf );
 }
 
+/*
+ *  Stream the progress of a console issued verification back to the console
+ *  - Semaphore MUST be acquired before calling this function
+ */
+void log_range_progress(void)
+{
+    char res[128];
+
+    if ( !range_bounded || !range_t0 )
+        return;
+    if ( range_blocks() )
+    {
+        snprintf( res, sizeof(res), "verify %u: frame 0x%s", range.session, rl_str( &job.base ) );
+        serial_out( res );
+        return;
+    }
+    snprintf( res, sizeof(res), "verify %u: done in %.1f s", range.session,
+              (esp_timer_get_time() - range_t0) * 1e-6 );
+    serial_out( res );
+    range_t0 = 0;  /* report the completion only once */
+}
+
 
 /*
  *  Define a way for Collatz computation to send message to other nodes
+ *  - msg is a collatz_t or a collatz_range_t, both start with magic and report_type
  */
-void broadcast_message( collatz_t *job )
+void broadcast_message( collatz_t *msg, int len )
 {
     app_header_t  hdr;
-    int           len = sizeof( collatz_t );
     
     if ( len <= NET_MAX_PAYLOAD )
     {
@@ -187,13 +256,13 @@ void broadcast_message( collatz_t *job )
         hdr.len  = len;
         if ( collatz_root )
         {
-            job->report_type &= ~BLOCK_UP;  /* make sure! */
-            net_send_down(  &hdr, (const uint8_t *)job);
+            msg->report_type &= ~BLOCK_UP;  /* make sure! */
+            net_send_down(  &hdr, (const uint8_t *)msg);
         }
         else
         {
-            job->report_type |= BLOCK_UP;
-            net_send_up(  &hdr, (const uint8_t *)job);
+            msg->report_type |= BLOCK_UP;
+            net_send_up(  &hdr, (const uint8_t *)msg);
         }
     }
 }
@@ -207,6 +276,8 @@ void report_my_progress(int fin)
 {
     int done = 0;
 
+    job.origin = net_node_id();
+
     if ( block[0]==BLOCK_DONE ) 
     {
         rl_add( &job.base, BLOCKSIZE );
@@ -216,6 +287,7 @@ void report_my_progress(int fin)
         ESP_LOGI(COMP, "Shifted %d blocks, the current frame is 0x%s, and block %d (fin %d)",
                  done, rl_str( &job.base ), job.block_id, fin );
         log_report_blocks();        
+        log_range_progress();
     }
     else if ( !fin )  /* progress elsewhere did not trigger changes to our state            */
         return;
@@ -226,7 +298,7 @@ void report_my_progress(int fin)
     
     /* what's done is done! */
     job.report_type = BLOCK_DONE;
-    broadcast_message( &job );
+    broadcast_message( &job, sizeof( collatz_t ) );
 }
 
 /*
@@ -236,8 +308,24 @@ void report_my_progress(int fin)
 void report_my_start(void)
 {
     ESP_LOGI(COMP, "Computing block %d from frame 0x%s", job.block_id, rl_str( &job.base ) );
+    job.origin      = net_node_id();
     job.report_type = BLOCK_TAKEN;
-    broadcast_message( &job );
+    broadcast_message( &job, sizeof( collatz_t ) );
+}
+
+/*
+ *  Send the current verification range to one node only
+ *  - Semaphore MUST be acquired before calling this function
+ */
+void send_range_to( uint8_t node_id )
+{
+    app_header_t  hdr;
+
+    hdr.type = APP_COLLATZ_ID;
+    hdr.len  = sizeof( collatz_range_t );
+    range.report_type = BLOCK_RANGE;
+    ESP_LOGI(COMP, "Node 0x%02X reports from session %u, resending range", node_id, range.session );
+    net_send_to( node_id, &hdr, (const uint8_t *)&range );
 }
 
 /**********************************************************/
@@ -250,6 +338,17 @@ void report_my_start(void)
 void process_report( const collatz_t *rpt )
 {
     int16_t rt  = rpt->report_type & BLOCK_MASK;
+    if ( rpt->session != job.session )
+    {
+        /*
+         *  The range is broadcast only once: a node which joined or restarted
+         *  since then keeps reporting from an older session.  The root tells it.
+         */
+        if ( collatz_root && range_bounded && rpt->origin &&
+             (int16_t)(rpt->session - job.session) < 0 )
+            send_range_to( rpt->origin );
+        return;   // belongs to another verification range
+    }
     ESP_LOGI(COMP, "Received a report for block %d frame 0x%s %s",
              rpt->block_id, rl_str( &rpt->base ),
              (rt==BLOCK_TAKEN ? "taken" : "done")
@@ -297,6 +396,7 @@ void process_report( const collatz_t *rpt )
         
         if ( !left )
             rl_set( &job.base, &rpt->base );
+        log_range_progress();
     }
     /* now new base == old base; and block id's are in the integer frame */
     if ( rpt->block_id >= 0 ) 
@@ -319,6 +419,69 @@ void process_report( const collatz_t *rpt )
     report_my_progress(0);
 }        
 
+/*
+ * Adopt a verification range received from elsewhere (or from the console)
+ *  - Older or current sessions are ignored
+ *  - Returns non-zero if the range was adopted, and should be passed on
+ *  - Semaphore MUST be acquired before calling this function
+ */
+int process_range( const collatz_range_t *rng )
+{
+    if ( (int16_t)(rng->session - job.session) <= 0 )
+        return 0;
+
+    memcpy( &range, rng, sizeof(collatz_range_t) );
+    range.report_type = BLOCK_RANGE;
+    range_bounded = 1;
+
+    job.session  = rng->session;
+    job.block_id = -1;  /* whatever we are doing is obsolete */
+    rl_set( &job.base, &rng->start );
+    for(int i=0; i<BLOCKS; i++)
+        block[i] = BLOCK_FREE;
+
+    ESP_LOGI(COMP, "Verification range %u adopted, frame 0x%s", rng->session, rl_str( &job.base ) );
+    return 1;
+}
+
+/*
+ *  Console entry: verify [start, end] over the whole network
+ *  - Acquires the semaphore itself
+ */
+int collatz_verify_range( const bigint_t *start, const bigint_t *end )
+{
+    collatz_range_t rng;
+    bigint_t        b;
+
+    /* the first integer checked is base+2, and base must be odd */
+    rl_set( &b, start );
+    if ( rl_sub( &b, (b.len && (b.a[0] & 1)) ? 2 : 1 ) || !b.len || rl_greater( start, end ) )
+        return -1;
+
+    memcpy( rng.magic, job.magic, 4 );
+    rng.report_type = BLOCK_RANGE;
+    rl_set( &rng.start, &b );
+    rl_set( &rng.end, end );
+
+    xSemaphoreTake( mutex, portMAX_DELAY );
+    rng.session = job.session + 1;
+    process_range( &rng );
+    range_t0 = esp_timer_get_time();
+    xSemaphoreGive( mutex );
+
+    broadcast_message( (collatz_t *)&rng, sizeof( collatz_range_t ) );
+    if ( !collatz_root )  /* our own subtree is not reached through the root */
+    {
+        app_header_t hdr;
+
+        hdr.type = APP_COLLATZ_ID;
+        hdr.len  = sizeof( collatz_range_t );
+        rng.report_type &= ~BLOCK_UP;
+        net_send_down( &hdr, (const uint8_t *)&rng );
+    }
+    return 0;
+}
+
 /*
  *  The actual work is done here -- compute one block:
  *  -  Semaphore is acquired when needed (at start, and at the end)
@@ -348,6 +511,7 @@ int compute_block( int bi )
             break;
     }
     report_my_start();  // inform others: (bd,bi) => BLOCK_TAKEN
+    uint16_t session = job.session;
     
     /* bd + bi*BLOCKSIZE */
     rl_set( &waterlevel, &job.base );
@@ -373,6 +537,8 @@ int compute_block( int bi )
         }
         while( rl_greater( &n, &waterlevel ) );
         rl_add( &waterlevel, 2 );
+        if ( !(i & 0xffff) && job.session != session )
+            return 0;  /* a new verification range was issued meanwhile */
 #if defined( LED_PIN )
         // 0xffff ~ 1sec
         led_count = (led_count + 1) & 0x1ffful;
@@ -410,6 +576,11 @@ void collatz_compute(void *pvParameter)
     while( 1 )
     {
         int b = pick_block();
+        if ( b < 0 )  /* verification range done, wait for the next one */
+        {
+            vTaskDelay( 1000 / portTICK_RATE_MS );
+            continue;
+        }
         if ( compute_block( b ) )
             break;
         taskYIELD();
@@ -438,40 +609,54 @@ int magic( const char *buf, const char *key )
 
 
 /*
- * Task responsible for communication
+ * Handle one incoming report, the buffer is borrowed from the network layer
  */
 
-void collatz_comm(void *pvParameter)
+void collatz_message( app_header_t *hdr, uint8_t *pay )
 {
-    printf("Collatz comm task started %s\n", collatz_root ? "(root)" : "");
-    while( 1 )
+    collatz_t *rpt = (collatz_t *)pay;
+    if ( magic( (const char *)pay, "f3n1" ) )
+        return;
+    if ( rpt->report_type & BLOCK_RANGE )
+    {
+        if ( hdr->len != sizeof( collatz_range_t ) )
+            return;
+    }
+    else if ( hdr->len != sizeof( collatz_t ) )
+        return;
+    if ( !(rpt->report_type & BLOCK_UP) || collatz_root )
     {
-        static app_header_t  hdr;
-        static uint8_t pay[ NET_MAX_PAYLOAD ];
+        int fwd = 1;
 
-        while ( !net_receive( APP_COLLATZ_ID, &hdr, pay, 4000 ) )
-        {
-            collatz_t *rpt = (collatz_t *)pay;
-            if ( hdr.len != sizeof( collatz_t ) || magic( (const char *)pay, "f3n1" ) )
-                continue;
-            if ( !(rpt->report_type & BLOCK_UP) || collatz_root )
-            {
-                rpt->report_type &= (~BLOCK_UP);
-                net_send_down( &hdr, pay );
+        rpt->report_type &= (~BLOCK_UP);
 
-                xSemaphoreTake( mutex, portMAX_DELAY );
-                process_report( rpt );
-                xSemaphoreGive( mutex );
-            }
-            else  /* packet on its way up */
-            {
-                net_send_up( &hdr, pay );
-            }
-            vTaskDelay( 20 / portTICK_RATE_MS);  // process the incoming reports at faster rate
-        }
-        vTaskDelay( 100 / portTICK_RATE_MS );  // not needed?!
+        xSemaphoreTake( mutex, portMAX_DELAY );
+        if ( rpt->report_type & BLOCK_RANGE )
+            fwd = process_range( (const collatz_range_t *)pay );
+        else
+            process_report( rpt );
+        xSemaphoreGive( mutex );
+
+        if ( fwd )
+            net_send_down( hdr, pay );
+    }
+    else  /* packet on its way up */
+    {
+        net_send_up( hdr, pay );
     }
 }
+
+
+/*
+ * Handler responsible for communication, called by the network layer
+ *  with every report that has arrived
+ */
+
+void collatz_comm( const net_msg_t *msgs, int count, void *ctx )
+{
+    for ( int i = 0; i < count; i++ )
+        collatz_message( msgs[i].head, msgs[i].data );
+}
         
 
 /**********************************************************/
@@ -485,8 +670,6 @@ void collatz_init(int root)
 
     collatz_root = root;  // affects our behavior
     
-    net_register_app( APP_COLLATZ_ID );
-    
     /* init data structures */
     job.magic[0] = 'f';
     job.magic[1] = '3';
@@ -512,15 +695,11 @@ void collatz_init(int root)
 
     mutex = xSemaphoreCreateMutex();          // to guard computation variables
 
-    /* then the tasks */
-    xTaskCreate(
-        &collatz_comm,     // - function ptr
-        "collatz-comm",    // - arbitrary name
-        2048,              // - stack size [byte]
-        NULL,              // - optional data for task
-        1,                 // - priority, higher than comp task
-        NULL);             // - handle to task (for control)
+    /* reports are handled on the network layer's app task */
+    net_register_app_handler( APP_COLLATZ_ID, collatz_comm, NULL );
+    printf("Collatz comm handler registered %s\n", collatz_root ? "(root)" : "");
 
+    /* then the task */
     xTaskCreate(
         &collatz_compute,  // - function ptr
         "collatz-comp",    // - arbitrary name
@@ -1,6 +1,8 @@
 #ifndef COLLATZ_H
 #define COLLATZ_H
 
+#include "rl_int.h"
+
 #define APP_COLLATZ_ID  2
 
 /*
@@ -8,4 +10,10 @@
  */
 void collatz_init(int root);
 
+/*
+ *  Restart the network-wide computation from start, and stop past end
+ *  - returns non-zero if the range is invalid (start must be > 1)
+ */
+int collatz_verify_range(const bigint_t *start, const bigint_t *end);
+
 #endif
@@ -11,6 +11,7 @@
 #include "background.h"
 #include "data.h"
 #include "command_functions.h"
+#include "collatz.h"
 
 #define MAX_STORED_VARIABLES 32
 #define RESPONSE_LENGTH 128
@@ -229,4 +230,20 @@ void data_info (const char * first) {
     return;
   }
 
-}
\ No newline at end of file
+}
+
+void collatz_verify(const char * first, const char * second) {
+  bigint_t start;
+  bigint_t end;
+  if (rl_parse(&start, first) != 0 || rl_parse(&end, second) != 0) {
+    sprintf(error, "invalid range bound");
+    serial_out("invalid range bound");
+    return;
+  }
+  if (collatz_verify_range(&start, &end) != 0) {
+    sprintf(error, "invalid range");
+    serial_out("invalid range");
+    return;
+  }
+  serial_out("verify started");
+}
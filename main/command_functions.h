@@ -18,4 +18,5 @@ void bt_status();
 void bt_close();
 void data_create(const char * first, const char * second);
 void data_destroy(const char * first);
-void data_info(const char * first);
\ No newline at end of file
+void data_info(const char * first);
+void collatz_verify(const char * first, const char * second);
\ No newline at end of file
@@ -84,6 +84,15 @@ void check_what_came_in() {
       data_info(first_argument);
     } else if (strcasecmp(query,"net_table") == 0) {
       net_table();
+    } else if (strcasecmp(query,"net_stats") == 0) {
+      net_stats();
+    } else if (strcasecmp(string_with_arguments,"net_root") == 0) {
+      char * first_argument = strtok(NULL," ");
+      net_root(first_argument);
+    } else if (strcasecmp(string_with_arguments,"collatz_verify") == 0) {
+      char * first_argument = strtok(NULL," ");
+      char * second_argument = strtok(NULL," ");
+      collatz_verify(first_argument, second_argument);
     } else {
       sprintf(error, "Command not recognized");
     }
@@ -157,28 +166,12 @@ void main_task(void *pvParameter) {
 
 
 void app_main(void) {
-  uint8_t local_mac[6];
-  esp_read_mac(local_mac, ESP_MAC_WIFI_STA);
-  uint8_t id = 0;
-  int root = 0;
-  if (local_mac[1] == 0xAE) {
-      // Black device:
-      id = 0x17;
-      root = 0;
-  } else if (local_mac[1] == 0x6F) {
-      // Yellow device.
-      id = 0x16;
-      root = 1; 
-  } else {
-      // If this error is emitted, you have probably forgotten to customize this
-      //  function to match with _your_ device MAC addresses.
-      ESP_LOGE("APP_MAIN", "Could not determine Node-id.");
-      while (1) {
-          vTaskDelay(1000 / portTICK_RATE_MS);
-      }
-  }
 	stack = createStack(32);
   ESP_ERROR_CHECK(nvs_flash_init());    
+  // The root is picked on the console ("net_root 1", then restart), every
+  //  other board leases its node-id from it once joined.
+  int root = net_root_load();
+  uint8_t id = (root ? 0x16 : 0);
   net_init(id, root);
 	counter = 0;
 
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <freertos/FreeRTOS.h>
@@ -10,6 +11,7 @@
 #include <freertos/task.h>
 
 #include <nvs_flash.h>
+#include <nvs.h>
 #include <esp_wifi.h>
 #include <esp_now.h>
 #include <esp_netif.h>
@@ -26,41 +28,87 @@ static const char* TAG = "NetworkLayer";
 
 NodeState node;
 LinkEntry link_broadcast = {
-    {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-    0xFF,
-    NULL
+    .mac = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+    .key = 0xFFFFFFFFFFFFull,
+    .id = 0xFF
 };
 
-QueueHandle_t outbound;
+OutboundClass outbound[TRAFFIC_CLASSES];
+SemaphoreHandle_t outbound_ready;
+
+// Data frames held back by their link's bucket, in arrival order.  Only the
+//  outbound worker touches them.
+OutboundItem deferred[OUTBOUND_DATA_SIZE];
+int deferred_count;
+
+RxRing rx_ring;
+
+RxBuffer rx_buffers[RX_BUFFER_COUNT];
+QueueHandle_t rx_free;
+
+PeerCache peers;
+
+RouteEntry routes[256];
+
+RssiNote rssi_note;
+
+PoolFrame frame_pool[FRAME_POOL_SIZE];
+QueueHandle_t frame_free;
+QueueHandle_t frame_reserve;
+
+// At the root: the MAC each node-id is leased to, all zero if free.
+uint8_t lease_macs[256][6];
+
+TimerWheel wheel;
 
 
 
 int net_init(uint8_t node_id, int isDebugRoot) {
-    assert(node_id != 0);
+    // The root hands out the leases, it cannot lease its own node-id.
+    assert(node_id != 0 || !isDebugRoot);
 
     init_sys();
+
+    int dynamic_id = (node_id == 0);
+    if (dynamic_id) {
+        node_id = lease_start();
+    }
     init_node(&node, node_id);
 
+    if (dynamic_id) {
+        node.dynamic_id = 1;
+        if (node_id >= LEASE_PROVISIONAL) {
+            node.flags |= STATE_UNLEASED;
+        }
+    }
+
     if (isDebugRoot) {
-        node.link_table.usage |= (1ul << LINK_UP);
+        // NOTE: The root's up-stream entry is marked in use, but never indexed.
+        node.link_table.usage[LINK_UP / 32] |= (1ul << (LINK_UP % 32));
         node.isRoot = 1;
+
+        lease_load();
+        uint8_t mac[6];
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        memcpy(lease_macs[node.id], mac, 6);
     }
-    else {
+    else if (rejoin_begin() != 0) {
         uint64_t wnd = PERIOD_LOCATE + (esp_random() % WINDOW_LOCATE);
-        if (esp_timer_start_once(node.join_timer, wnd) != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to start network join timer.");
-            return -1;
-        }
+        wheel_start(&node.join_timer, wnd);
     }
 
     return 0;
 }
 
+uint8_t net_node_id() {
+    return node.id;
+}
+
 void net_table() {
   char res[40];
   int lined_nodes = 0;
   for (int i = 0; i < LINK_TABLE_SIZE; i++) {
-    if (node.link_table.usage & (1ul << i)) {
+    if (link_used(&node.link_table, i)) {
       lined_nodes++;
       snprintf(res, sizeof(res), "%d %02X %02X:%02X:%02X:%02X:%02X:%02X",
         i,
@@ -80,43 +128,219 @@ void net_table() {
   }
 }
 
+void net_stats() {
+  static const char* names[TRAFFIC_CLASSES] = { "control", "data" };
+  char res[64];
+  for (int i = 0; i < TRAFFIC_CLASSES; i++) {
+    snprintf(res, sizeof(res), "%s sent %u dropped %u peak %u/%u",
+      names[i],
+      outbound[i].sent,
+      outbound[i].dropped,
+      outbound[i].high_water,
+      outbound[i].depth);
+    serial_out(res);
+  }
+  snprintf(res, sizeof(res), "paced deferred %u waiting %d",
+    outbound[CLASS_DATA].deferred,
+    deferred_count);
+  serial_out(res);
+  snprintf(res, sizeof(res), "inbound received %u dropped %u starved %u peak %u/%u",
+    rx_ring.received,
+    rx_ring.dropped,
+    rx_ring.starved,
+    rx_ring.high_water,
+    RX_RING_SIZE);
+  serial_out(res);
+  snprintf(res, sizeof(res), "peers installed %u evicted %u",
+    peers.installed,
+    peers.evicted);
+  serial_out(res);
+  snprintf(res, sizeof(res), "interest %08X%08X pruned %u fanned %u",
+    (uint32_t)(node.interest_sent >> 32),
+    (uint32_t)node.interest_sent,
+    node.pruned,
+    node.fanned);
+  serial_out(res);
+  snprintf(res, sizeof(res), "failover %u lost %u depth %u",
+    node.orphaned,
+    node.orphan_lost,
+    node.depth);
+  serial_out(res);
+  LinkEntry* up = &node.link_table.entry[LINK_UP];
+  snprintf(res, sizeof(res), "status sent %u skipped %u",
+    node.status_sent,
+    node.status_skipped);
+  serial_out(res);
+  snprintf(res, sizeof(res), "credit %d held %u throttled %u",
+    up->credited ? (int8_t)(up->credit_limit - up->credit_seq) : -1,
+    uxQueueMessagesWaiting(node.held_queue),
+    node.throttled);
+  serial_out(res);
+  snprintf(res, sizeof(res), "id %02X%s leases %u",
+    node.id,
+    (node.flags & STATE_UNLEASED) ? " provisional" : "",
+    node.leases);
+  serial_out(res);
+  snprintf(res, sizeof(res), "timers fired %u tick %u",
+    wheel.fired,
+    wheel.now);
+  serial_out(res);
+}
+
+void net_root(const char* arg) {
+  if (arg == NULL) {
+    serial_out(net_root_load() ? "root 1" : "root 0");
+    return;
+  }
+  if (strcmp(arg, "0") != 0 && strcmp(arg, "1") != 0) {
+    sprintf(error, "invalid value for net_root command");
+    serial_out("invalid value for net_root command");
+    return;
+  }
+  if (net_root_save(arg[0] == '1') != 0) {
+    sprintf(error, "failed to save root flag");
+    serial_out("failed to save root flag");
+    return;
+  }
+  serial_out("root flag saved, restart to apply");
+}
+
+/*
+* Method reads whether this board is the root, kept in NVS and set from the
+*  console (net_root).  NVS must be initialized.
+* Returns non-zero for the root.
+*/
+int net_root_load() {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return 0;
+    }
+    uint8_t root = 0;
+    esp_err_t err = nvs_get_u8(h, NVS_KEY_ROOT, &root);
+    nvs_close(h);
+
+    return (err == ESP_OK && root != 0);
+}
+
+/*
+* Method records whether this board is the root, see net_root_load().
+* Returns 0 on success, non-zero on failure.
+*/
+int net_root_save(int root) {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS, root flag not saved.");
+        return -1;
+    }
+    esp_err_t err = nvs_set_u8(h, NVS_KEY_ROOT, (root ? 1 : 0));
+    if (err == ESP_OK) {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save root flag.");
+        return -2;
+    }
+    return 0;
+}
+
 int net_register_app(uint16_t app_id) {
     assert(app_id > 0);
 
-    uint32_t slot = 0xFFFFFFFF;
-    for (int i = 0; i < 32; ++i) {
-        uint32_t mask = (1ul << i);
-        if (!(node.app_table.usage & mask)) {
-            if (node.app_table.apps[i].id == 0 && slot >= 32) {
-                slot = i;
-            }
-        }
-        else if (node.app_table.apps[i].id == app_id) {
-            ESP_LOGE(TAG, "Error: Application type %d already registered.", app_id);
-            return -1;
-        }
+    return app_register(app_id, NULL, NULL);
+}
+
+int net_register_app_handler(uint16_t app_id, net_handler_t cb, void* ctx) {
+    assert(app_id > 0);
+    assert(cb != NULL);
+
+    return app_register(app_id, cb, ctx);
+}
+
+/*
+* Method adds an application to the app table, with a handler to be called on
+*  the app-dispatch task, or none if the application receives by itself.
+*/
+int app_register(uint16_t app_id, net_handler_t handler, void* ctx) {
+    while (xSemaphoreTake(node.app_table.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
     }
 
-    if (slot > 32) {
-        // Failed to find an empty slot:
+    const AppSnapshot* snap = node.app_table.current;
+    if (snap->apps[app_probe(snap, app_id)].id == app_id) {
+        xSemaphoreGive(node.app_table.lock);
+        ESP_LOGE(TAG, "Error: Application type %d already registered.", app_id);
+        return -1;
+    }
+    if (snap->count >= APP_TABLE_SIZE) {
+        xSemaphoreGive(node.app_table.lock);
         ESP_LOGE(TAG, "Error: Could not register application type %d, application table full.", app_id);
         return -2;
     }
 
-    while (xSemaphoreTake(node.app_table.lock, WAIT_LOCK) != pdTRUE) {
-        // Spin..
+    QueueHandle_t inbound = xQueueCreate(INBOUND_QUEUE_SIZE, sizeof(RxMessage));
+    uint32_t* waiting = calloc(1, sizeof(uint32_t));
+    if (inbound == NULL || waiting == NULL) {
+        if (inbound != NULL) {
+            vQueueDelete(inbound);
+        }
+        free(waiting);
+        xSemaphoreGive(node.app_table.lock);
+        ESP_LOGE(TAG, "Error: Could not create inbound queue for application type %d.", app_id);
+        return -3;
     }
-    node.app_table.usage |= (1ul << slot);
-    node.app_table.apps[slot].id = app_id;
-    node.app_table.apps[slot].inbound = xQueueCreate(INBOUND_QUEUE_SIZE, sizeof(app_header_t) + NET_MAX_PAYLOAD);
+
+    AppQueue app = { app_id, inbound, handler, ctx, waiting };
+    app_publish(&node.app_table, &app, 0);
     xSemaphoreGive(node.app_table.lock);
+
+    subscribe_update(0);
     return 0;
 }
 
 
+/*
+* Method removes an app-id.  Its inbound queue is deleted once no dispatch can
+*  reach it any longer, and any receivers blocked on it have been woken with a
+*  NULL buffer, see net_receive_borrow(..).
+*/
 int net_unregister_app(uint16_t app_id) {
-    ESP_LOGW(TAG, "net_unregister_app(..) is currently stubbed in.  Functionality reserved for future versions.");
-    return -1;
+    assert(app_id > 0);
+
+    while (xSemaphoreTake(node.app_table.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+
+    const AppSnapshot* snap = node.app_table.current;
+    const AppQueue* app = &snap->apps[app_probe(snap, app_id)];
+    if (app->id != app_id) {
+        xSemaphoreGive(node.app_table.lock);
+        ESP_LOGE(TAG, "Error: Application type %d not registered.", app_id);
+        return -1;
+    }
+
+    QueueHandle_t inbound = app->inbound;
+    uint32_t* waiting = app->waiting;
+    app_publish(&node.app_table, NULL, app_id);
+    xSemaphoreGive(node.app_table.lock);
+
+    // No receiver can find the queue any more, but some may still wait on it.
+    RxMessage item = { NULL, NULL };
+    while (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) != 0) {
+        xQueueSend(inbound, &item, 0);
+        vTaskDelay(1);
+    }
+    while (xQueueReceive(inbound, &item, 0) == pdTRUE) {
+        if (item.buffer != NULL) {
+            rx_release(item.buffer);
+        }
+    }
+    vQueueDelete(inbound);
+    free(waiting);
+
+    subscribe_update(0);
+    return 0;
 }
 
 
@@ -124,6 +348,39 @@ int net_send_up(const app_header_t* head, const uint8_t* data) {
     assert(head != NULL);
     assert(data != NULL);
 
+    return send_up(head, data, node.id);
+}
+
+int net_send_up_wait(const app_header_t* head, const uint8_t* data, int32_t timeout) {
+    assert(head != NULL);
+    assert(data != NULL);
+
+    TickType_t start = xTaskGetTickCount();
+    int result;
+    while ((result = send_up(head, data, node.id)) == NET_WOULD_BLOCK) {
+        TickType_t wait = UINT32_MAX;
+        if (timeout >= 0) {
+            TickType_t spent = xTaskGetTickCount() - start;
+            if (spent >= timeout / portTICK_RATE_MS) {
+                break;
+            }
+            wait = timeout / portTICK_RATE_MS - spent;
+        }
+        xSemaphoreTake(node.credit_ready, wait);
+    }
+
+    // Several senders may be waiting, pass the wake-up on while there is room.
+    if (result == 0 && uplink_ready()) {
+        xSemaphoreGive(node.credit_ready);
+    }
+    return result;
+}
+
+/*
+* Method sends an application message up-stream on behalf of the node it
+*  originated from, which routing below the parent learns from.
+*/
+int send_up(const app_header_t* head, const uint8_t* data, NodeId origin) {
     if (node.isRoot) {
         ESP_LOGI(TAG, "Root node send_up(..) -- ignoring.");
         return 0;
@@ -131,7 +388,8 @@ int net_send_up(const app_header_t* head, const uint8_t* data) {
 
     // NOTE: This method does NOT verify that outbound packets have a valid app-id.
 
-    if (!has_uplink(&node.link_table)) {
+    int orphan = (node.flags & STATE_ORPHAN);
+    if (!has_uplink(&node.link_table) && !orphan) {
         ESP_LOGW(TAG, "net_send_up(..) failure.  No up-stream link.");
         return -1;
     }
@@ -140,105 +398,198 @@ int net_send_up(const app_header_t* head, const uint8_t* data) {
         return -2;
     }
 
-    NetFrame out = {};
-    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-    out.head.source = node.id;
-    out.head.destination = node.link_table.entry[LINK_UP].id;
-    out.head.control = CONTROL_DEFAULT;
+    if (!uplink_ready()) {
+        node.throttled++;
+        return NET_WOULD_BLOCK;
+    }
+
+    app_header_t stamped = *head;
+    stamped.reserved[APP_RES_ORIGIN] = origin;
+    head = &stamped;
+
+    // Parents speaking the compact format also understand bundles, so small
+    //  messages can share one transmission.
+    if (!orphan && node.link_table.entry[LINK_UP].version == NETWORK_VERSION_COMPACT) {
+        return bundle_append(head, data);
+    }
+
+    NetFrame* out = frame_alloc(CLASS_DATA);
+    if (out == NULL) {
+        return -3;
+    }
+    out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out->head.source = node.id;
+    out->head.destination = node.link_table.entry[LINK_UP].id;
+    out->head.control = CONTROL_DEFAULT;
 
-    memcpy(out.contents, head, sizeof(app_header_t));
+    memcpy(out->contents, head, sizeof(app_header_t));
 
     // NOTE: Is this still well-behaved if len == 0?  Verify.
-    memcpy(out.contents + sizeof(app_header_t), data, head->len);
+    memcpy(out->contents + sizeof(app_header_t), data, head->len);
+    out->head.reserved[RES_LENGTH] = sizeof(app_header_t) + head->len;
 
-    out.head.checksum = pak_checksum(&out);
-    net_send_raw(&out);
+    while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    uplink_send(out);
+    xSemaphoreGive(node.up_lock);
+
+    frame_release(out);
     return 0;
 }
 
 
 int net_send_down(const app_header_t* head, const uint8_t* data) {
+    return net_send_down_flags(head, data, 0);
+}
+
+int net_send_down_flags(const app_header_t* head, const uint8_t* data, int flags) {
     assert(head != NULL);
     assert(data != NULL);
 
+    return send_down(head, data, flags);
+}
+
+/*
+* Method sends an application message to every interested down-stream link,
+*  keeping the sender's flags with it for the nodes further down.
+*/
+int send_down(const app_header_t* head, const uint8_t* data, int flags) {
     if (head->len > NET_MAX_PAYLOAD) {
         ESP_LOGW(TAG, "net_send_down(..) failure.  Invalid length: %d", head->len);
         return -2;
     }
 
-    NetFrame out = {};
-    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-    out.head.source = node.id;
-    out.head.control = CONTROL_DEFAULT;
+    NetFrame* out = frame_alloc(CLASS_DATA);
+    if (out == NULL) {
+        return -3;
+    }
+    out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out->head.source = node.id;
+    out->head.control = CONTROL_DEFAULT;
 
-    memcpy(out.contents, head, sizeof(app_header_t));
+    memcpy(out->contents, head, sizeof(app_header_t));
+    ((app_header_t*)out->contents)->reserved[APP_RES_FLAGS] = flags;
     // NOTE: Is this still well-behaved if len == 0?  Verify.
-    memcpy(out.contents + sizeof(app_header_t), data, head->len);
+    memcpy(out->contents + sizeof(app_header_t), data, head->len);
+    out->head.reserved[RES_LENGTH] = sizeof(app_header_t) + head->len;
 
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (i == LINK_UP)
-            continue;
+    net_send_subscribed(out, head->type, flags);
+    frame_release(out);
+    return 0;
+}
 
-        if (node.link_table.usage & (1ul << i)) {
-            out.head.destination = node.link_table.entry[i].id;
-            out.head.checksum = pak_checksum(&out);
-            net_send_raw(&out);
-        }
+int net_send_to(uint8_t node_id, const app_header_t* head, const uint8_t* data) {
+    assert(head != NULL);
+    assert(data != NULL);
+
+    if (node_id == 0 || node_id == node.id || node_id == link_broadcast.id) {
+        ESP_LOGW(TAG, "net_send_to(..) failure.  Invalid destination: 0x%02X", node_id);
+        return -1;
+    }
+    if (head->len > NET_MAX_PAYLOAD) {
+        ESP_LOGW(TAG, "net_send_to(..) failure.  Invalid length: %d", head->len);
+        return -2;
     }
+
+    NetFrame* out = frame_alloc(CLASS_DATA);
+    if (out == NULL) {
+        return -3;
+    }
+    out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out->head.source = node.id;
+    out->head.control = CONTROL_UNICAST;
+    out->head.reserved[RES_TARGET] = node_id;
+
+    memcpy(out->contents, head, sizeof(app_header_t));
+    ((app_header_t*)out->contents)->reserved[APP_RES_ORIGIN] = node.id;
+    memcpy(out->contents + sizeof(app_header_t), data, head->len);
+    out->head.reserved[RES_LENGTH] = sizeof(app_header_t) + head->len;
+
+    route_forward(out, 0);
+    frame_release(out);
     return 0;
 }
 
 int net_receive(uint16_t app_id, app_header_t* h, uint8_t* d, int32_t timeout) {
-    assert(app_id > 0);
     assert(h != NULL);
     assert(d != NULL);
 
-    uint8_t buffer[NET_MAX_PAYLOAD + sizeof(app_header_t)];
+    net_msg_t msg;
+    int result = net_receive_borrow(app_id, &msg, timeout);
+    if (result != 0) {
+        return result;
+    }
 
-    // Some offset pointers for convenience into the buffer.
-    app_header_t* head = (app_header_t*)buffer;
-    uint8_t* data = buffer + sizeof(app_header_t);
+    if (msg.head->len > NET_MAX_PAYLOAD) {
+        ESP_LOGW(TAG, "Received nominally overlength (%d) packet, truncating.", msg.head->len);
+        msg.head->len = NET_MAX_PAYLOAD;
+    }
+    memcpy(h, msg.head, sizeof(app_header_t));
+    memcpy(d, msg.data, msg.head->len);
+    net_release(&msg);
+    return 0;
+}
 
-    QueueHandle_t qh = find_app(app_id);
+int net_receive_borrow(uint16_t app_id, net_msg_t* msg, int32_t timeout) {
+    assert(app_id > 0);
+    assert(msg != NULL);
+
+    // Counted as waiting before leaving the read section, so an unregister
+    //  cannot delete the queue under us.
+    app_read_lock();
+    const AppQueue* app = app_lookup(app_id);
+    QueueHandle_t qh = (app != NULL ? app->inbound : NULL);
+    uint32_t* waiting = (app != NULL ? app->waiting : NULL);
+    if (waiting != NULL) {
+        __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    app_read_unlock();
 
     if (qh == NULL) {
         ESP_LOGE(TAG, "Error: Application type %d not registered.", app_id);
         return -1;
     }
 
+    RxMessage item = { NULL, NULL };
+    int received = pdTRUE;
     if (timeout < 0) {
-        while (xQueueReceive(qh, buffer, UINT32_MAX) != pdTRUE) {
+        while (xQueueReceive(qh, &item, UINT32_MAX) != pdTRUE) {
             // Spin...
         }
     }
     else {
-        if (xQueueReceive(qh, buffer, timeout / portTICK_RATE_MS) != pdTRUE) {
-            return -2;
-        }
+        received = xQueueReceive(qh, &item, timeout / portTICK_RATE_MS);
     }
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
 
-    if (head->len > NET_MAX_PAYLOAD) {
-        ESP_LOGW(TAG, "Received nominally overlength (%d) packet, truncating.", head->len);
-        head->len = NET_MAX_PAYLOAD;
+    if (received != pdTRUE) {
+        return -2;
+    }
+    if (item.buffer == NULL) {
+        // Woken by net_unregister_app(..).
+        ESP_LOGE(TAG, "Error: Application type %d not registered.", app_id);
+        return -1;
     }
-    memcpy(h, head, sizeof(app_header_t));
-    memcpy(d, data, head->len);
+
+    msg->head = item.head;
+    msg->data = (uint8_t*)(item.head + 1);
+    msg->token = item.buffer;
     return 0;
 }
 
+void net_release(net_msg_t* msg) {
+    assert(msg != NULL);
+    assert(msg->token != NULL);
 
-
-/*
-* TIMER CALLBACK method for the LINK proposals originating from this node.
-*  This callback only fires if the timeout for response has elapsed.
-*/
-void timer_cb_pending_link(void* param) {
-    node.flags &= ~STATE_PENDING_LINK;
-    esp_now_del_peer(node.pending_mac);
-    memset(node.pending_mac, 0, 6);
-    node.pending_id = 0;
+    rx_release((RxBuffer*)msg->token);
+    msg->head = NULL;
+    msg->data = NULL;
+    msg->token = NULL;
 }
 
+
+
 /*
 * TIMER CALLBACK method for the LOCATE interval.  Node should pick ONE
 *  proposal and accept it -- this becomes the up-stream link.
@@ -247,57 +598,87 @@ void timer_cb_pending_link(void* param) {
 void timer_cb_locating(void* param) {
     node.flags &= ~(STATE_LOCATING);
 
+    if (node.flags & STATE_REOPT) {
+        node.flags &= ~(STATE_REOPT);
+        reopt_choose();
+
+        node.loc_count = 0;
+        memset(node.loc_response, 0, sizeof(node.loc_response));
+        return;
+    }
+    if (node.flags & STATE_ORPHAN) {
+        orphan_choose();
+
+        node.loc_count = 0;
+        memset(node.loc_response, 0, sizeof(node.loc_response));
+        return;
+    }
+    if (node.flags & STATE_DIRECT) {
+        if (node.loc_count == 0 && ++node.direct_tries < DIRECT_ATTEMPTS) {
+            // The parent may still be rejoining itself after the same blackout,
+            //  or have all its pending slots taken by other joiners.
+            wheel_start(&node.join_timer, DIRECT_RETRY);
+            return;
+        }
+
+        node.flags &= ~(STATE_DIRECT);
+        node.direct.id = 0;
+    }
+
     // Ensure we got more than zero responses.  If not, restart the
     //  network join timer.
     if (node.loc_count == 0) {
         ESP_LOGW(TAG, "Failed to join network -- no nodes proposed LINK.");
 
         uint64_t wnd = PERIOD_LOCATE + (esp_random() % WINDOW_LOCATE);
-        if (esp_timer_start_once(node.join_timer, wnd) != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to start network join timer.");
-        }
+        wheel_start(&node.join_timer, wnd);
         return;
     }
 
-    NetFrame out = {};
-    esp_now_peer_info_t peerInfo = {};
-
-    // Pick a random node of those that responded.
-    uint32_t x = esp_random() % node.loc_count;
-    memcpy(peerInfo.peer_addr, node.loc_response[x].mac, 6);
-    peerInfo.channel = 0;
-    peerInfo.ifidx = ESP_IF_WIFI_STA;
-    peerInfo.encrypt = false;
-    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to add up-stream link peer.");
-        return;
+    // Pick the cheapest of the nodes that responded, at random among equals.
+    uint32_t x = 0;
+    int best = parent_cost(&node.loc_response[0]);
+    int ties = 1;
+    for (uint32_t i = 1; i < node.loc_count; ++i) {
+        int cost = parent_cost(&node.loc_response[i]);
+        if (cost < best) {
+            best = cost;
+            x = i;
+            ties = 1;
+        }
+        else if (cost == best && esp_random() % ++ties == 0) {
+            x = i;
+        }
     }
+    uplink_adopt(&node.loc_response[x]);
 
-    form_uplink(&node.link_table, node.loc_response[x].mac, node.loc_response[x].id);
-
-    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-    out.head.source = node.id;
-    out.head.destination = node.loc_response[x].id;
-    out.head.control = CONTROL_LINK;
-    out.head.reserved[RES_IDENT] = node.loc_ident;
-    out.head.checksum = pak_checksum(&out);
-
-    net_send_raw(&out);
-
-    ESP_LOGI(TAG, "Added up-stream link 0x%02X", node.loc_response[x].id);
+    ESP_LOGI(TAG, "Added up-stream link 0x%02X (rssi %d, depth %u, cost %d)",
+        node.loc_response[x].id, node.loc_response[x].rssi, node.depth, best);
 
     node.loc_count = 0;
-    memset(node.loc_response, 0, sizeof(LinkEntry) * LOCATE_SIZE);
+    memset(node.loc_response, 0, sizeof(node.loc_response));
 }
 
 /*
 * TIMER CALLBACK method -- fires if an up-stream status check times out without
-*  a valid response.  This should trigger a downstream blackout.
+*  a valid response.  A parent we are migrating to is given up in favour of the
+*  old one, otherwise we become an orphan: the children are kept, up-stream
+*  traffic is held and a new parent is located, see orphan_begin(..).
 */
 void timer_cb_up_status(void* param) {
+    // Answered by other traffic just as the timer fired.
+    if (!(node.flags & STATE_UPLINK_STATUS))
+        return;
+
     ESP_LOGE(TAG, "Failed to receive up-stream status response.");
 
-    exec_blackout();
+    // A new parent which does not answer is given up, the old one never let go.
+    if (node.flags & STATE_MIGRATING) {
+        migrate_revert();
+        return;
+    }
+
+    orphan_begin();
 }
 
 /*
@@ -311,28 +692,44 @@ void timer_cb_upstream(void* param) {
     //  is initialized as debug root.  Thus we need not check whether this node
     //  is root or not before trying to send a packet upstream.
 
-    NetFrame out = {};
-    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-    out.head.source = node.id;
-    out.head.destination = node.link_table.entry[LINK_UP].id;
-    out.head.control = CONTROL_STATUS;
-    out.head.checksum = pak_checksum(&out);
+    // The UNLINK to the parent we left is long gone.
+    if (!(node.flags & STATE_MIGRATING)) {
+        node.former.id = 0;
+    }
 
-    net_send_raw(&out);
+    // Re-advertise with every check, in case an earlier one was lost.
+    subscribe_update(1);
+    if (node.flags & STATE_UNLEASED) {
+        lease_request();
+    }
 
-    if (esp_timer_start_once(node.status_timer, TIMEOUT_STATUS) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start STATUS check timer.");
-        return;
+    // Traffic both ways since the last check already shows the link alive, to
+    //  the parent as much as to us.  A new parent is always checked, and so is
+    //  one we are waiting on for credit, see credit_request(..).
+    LinkEntry* up = &node.link_table.entry[LINK_UP];
+    int64_t now = esp_timer_get_time();
+    if (!(node.flags & STATE_MIGRATING) && !uplink_starved() &&
+        now - up->last_rx < PERIOD_UP_STATUS && now - up->last_tx < PERIOD_UP_STATUS) {
+        node.status_skipped++;
     }
+    else {
+        NetFrame out = {};
+        out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        out.head.source = node.id;
+        out.head.destination = up->id;
+        out.head.control = CONTROL_STATUS;
+
+        net_send_raw(&out);
+        node.status_sent++;
 
-    node.flags |= STATE_UPLINK_STATUS;
+        wheel_start(&node.status_timer, TIMEOUT_STATUS);
+
+        node.flags |= STATE_UPLINK_STATUS;
+    }
 
     // Restart the up-stream check timer.
     uint64_t wnd = PERIOD_UP_STATUS + (esp_random() % WINDOW_UP_STATUS);
-    if (esp_timer_start_once(node.link_table.entry[LINK_UP].timer, wnd) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to restart up-stream status timer.");
-        return;
-    }
+    wheel_start(&node.link_table.entry[LINK_UP].timer, wnd);
 }
 
 /*
@@ -342,15 +739,23 @@ void timer_cb_upstream(void* param) {
 void timer_cb_downstream(void* param) {
     int x = (int)param;
 
-    assert(x != LINK_UP && x < LINK_TABLE_SIZE && (node.link_table.usage & (1ul << x)));
+    assert(x != LINK_UP && x < LINK_TABLE_SIZE && link_used(&node.link_table, x));
 
-    ESP_LOGI(TAG, "Down-stream link %d, %02X decayed.", x, node.link_table.entry[x].id);
+    // Frames from the child do not restart the timer, it is only pushed back
+    //  here, by the time since the last one.
+    LinkEntry* link = &node.link_table.entry[x];
+    int64_t quiet = esp_timer_get_time() - link->last_rx;
+    if (quiet < TIMEOUT_LINK_DECAY) {
+        wheel_start(&link->timer, TIMEOUT_LINK_DECAY - quiet);
+        return;
+    }
 
-    esp_now_del_peer(node.link_table.entry[x].mac);
+    ESP_LOGI(TAG, "Down-stream link %d, %02X decayed.", x, link->id);
 
-    node.link_table.usage &= ~(1ul << x);
-    node.link_table.entry[x].id = 0;
-    memset(node.link_table.entry[x].mac, 0, 6);
+    // NOTE: The driver peer is left to idle out of the peer cache.
+    link_remove(&node.link_table, x);
+
+    subscribe_update(0);
 }
 
 /*
@@ -359,80 +764,280 @@ void timer_cb_downstream(void* param) {
 */
 void timer_cb_join(void* param) {
     node.flags |= STATE_LOCATING;
+    send_locate();
+}
+
+/*
+* TIMER CALLBACK method -- when this timer fires a linked node looks for a better
+*  parent, by locating as when joining.  See reopt_choose(..).
+*/
+void timer_cb_reopt(void* param) {
+    const uint32_t busy = (STATE_LOCATING | STATE_UPLINK_STATUS | STATE_FROZEN |
+        STATE_MIGRATING);
+
+    if (!(node.flags & busy) && has_uplink(&node.link_table)) {
+        node.flags |= (STATE_LOCATING | STATE_REOPT);
+        send_locate();
+        return;
+    }
+
+    uint64_t wnd = PERIOD_REOPT + (esp_random() % WINDOW_REOPT);
+    wheel_start(&node.reopt_timer, wnd);
+}
+
+/*
+* Method broadcasts a LOCATE packet (or sends it to the target of a direct join)
+*  and starts the window for LINK proposals.
+*/
+void send_locate() {
+    int direct = (node.flags & STATE_DIRECT);
 
     NetFrame out = {};
     out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
     out.head.source = node.id;
-    out.head.destination = link_broadcast.id;
+    out.head.destination = (direct ? node.direct.id : link_broadcast.id);
     out.head.control = CONTROL_LOCATE;
     out.head.reserved[RES_IDENT] = ++node.loc_ident;
-    out.head.checksum = pak_checksum(&out);
 
     net_send_raw(&out);
 
-    if (esp_timer_start_once(node.loc_timer, TIMEOUT_LOCATE) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start LOCATE timer.");
-        return;
-    }
+    wheel_start(&node.loc_timer, direct ? TIMEOUT_DIRECT : TIMEOUT_LOCATE);
 }
 
 /*
-* The callback method for esp-now packet receival serves as a dispatch function.
-*  It does simple verification of network layer state, and determines where the
-*  packet needs to be enqueued for processing or immediately dealt with.
+* The callback method for esp-now packet receival.  It runs in the Wi-Fi driver
+*  task, so it only copies the packet into a receive buffer, queues that on the
+*  receive ring and wakes the inbound worker; a full ring, or an empty buffer
+*  pool, drops the packet.
 */
 void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
-    if (!valid_packet(mac, data, len)) {
+    if (len <= 0 || len > ESP_NOW_MAX_DATA_LEN) {
         return;
     }
 
-    const NetFrame* frame = (const NetFrame*)data;
-    NodeId src = frame->head.source;
+    uint32_t head = rx_ring.head;
+    uint32_t tail = __atomic_load_n(&rx_ring.tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= RX_RING_SIZE) {
+        rx_ring.dropped++;
+        return;
+    }
+    RxBuffer* rx = rx_alloc();
+    if (rx == NULL) {
+        rx_ring.starved++;
+        return;
+    }
 
-    NetFrame out = {};
+    // The one copy of the packet: it is decoded where it lands, and its
+    //  application messages are lent out from there.
+    memcpy(wire_place(&rx->frame, data[0]), data, len);
+    memcpy(rx->mac, mac, 6);
+    rx->len = len;
+    rx->format = data[0];
+    rx->rssi = rssi_take(mac);
+    rx_ring.slot[head % RX_RING_SIZE] = rx;
+    __atomic_store_n(&rx_ring.head, head + 1, __ATOMIC_RELEASE);
+
+    rx_ring.received++;
+    if (head + 1 - tail > rx_ring.high_water) {
+        rx_ring.high_water = head + 1 - tail;
+    }
 
-    esp_now_peer_info_t peerInfo = {};
+    // NOTE: The callback is registered before the worker exists.
+    if (node.svc_inbound != NULL) {
+        xTaskNotifyGive(node.svc_inbound);
+    }
+}
 
-    switch (frame->head.control) {
-    case CONTROL_LOCATE:
-        if (node.flags & STATE_FROZEN) break;
+/*
+* ESP-NOW send callback -- runs in the Wi-Fi driver task once the radio is done
+*  with a frame.  Only a frame the peer acknowledged shows the link working, so
+*  only that counts as traffic to it in timer_cb_upstream(..).
+*/
+void espnow_sent(const uint8_t* mac, esp_now_send_status_t status) {
+    if (status != ESP_NOW_SEND_SUCCESS || mac == NULL)
+        return;
 
-        // There is only one circumstance in which we would respond to a LOCATE
-        //  packet.  The node must:
-        //      - have an up-stream link.
-        //      - have available entries in the link table.
-        //      - not already be awaiting a response to a LINK proposal.
-        if (has_uplink(&node.link_table) &&
-            has_available_downlinks(&node.link_table) > 0 &&
-            !(node.flags & STATE_PENDING_LINK)) {
-            // Set the pending flag (link proposal) and then
-            //  enqueue the LINK packet.
-            node.flags |= STATE_PENDING_LINK;
-            out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-            out.head.source = node.id;
-            out.head.destination = src;
-            out.head.control = CONTROL_LINK;
-            out.head.reserved[RES_IDENT] = frame->head.reserved[RES_IDENT];
-            out.head.checksum = pak_checksum(&out);
-
-            node.pending_id = src;
-            memcpy(node.pending_mac, mac, 6);
-            memcpy(peerInfo.peer_addr, mac, 6);
-            peerInfo.channel = 0;
-            peerInfo.ifidx = ESP_IF_WIFI_STA;
-            peerInfo.encrypt = false;
-            if (esp_now_add_peer(&peerInfo) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to add pending link peer.");
-                break;
-            }
+    int x = link_by_mac(&node.link_table, mac_pack(mac));
+    if (x >= 0) {
+        node.link_table.entry[x].last_tx = esp_timer_get_time();
+    }
+}
 
-            net_send_raw(&out);
+/*
+* Wi-Fi promiscuous callback -- notes the signal strength and sender of each
+*  vendor-specific action frame, the kind ESP-NOW sends, which espnow_recv(..)
+*  is invoked with next.
+*/
+void promisc_recv(void* buf, wifi_promiscuous_pkt_type_t type) {
+    const wifi_promiscuous_pkt_t* pkt = (const wifi_promiscuous_pkt_t*)buf;
+    if (type != WIFI_PKT_MGMT || pkt->rx_ctrl.sig_len < 25)
+        return;
+    // Frame control: action frame; category after the 24 byte MAC header.
+    if (pkt->payload[0] != 0xD0 || pkt->payload[24] != 0x7F)
+        return;
 
-            if (esp_timer_start_once(node.pending_timer, TIMEOUT_PROPOSE_LINK) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to start LINK proposal timer.");
-                break;
+    __atomic_add_fetch(&rssi_note.seq, 1, __ATOMIC_ACQ_REL);
+    // Transmitter address, after frame control, duration and receiver address.
+    memcpy(rssi_note.mac, pkt->payload + 10, 6);
+    rssi_note.rssi = pkt->rx_ctrl.rssi;
+    __atomic_add_fetch(&rssi_note.seq, 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Method returns the signal strength promisc_recv(..) noted for the frame just
+*  received from 'mac', or 0 if it has none.  Each note is taken once, so a
+*  frame the promiscuous path missed is not credited with an older reading.
+*  Called from espnow_recv(..) only.
+*/
+int8_t rssi_take(const uint8_t* mac) {
+    static uint32_t taken;
+
+    uint32_t seq;
+    uint8_t from[6];
+    int8_t rssi;
+    do {
+        seq = __atomic_load_n(&rssi_note.seq, __ATOMIC_ACQUIRE);
+        memcpy(from, rssi_note.mac, 6);
+        rssi = rssi_note.rssi;
+    } while ((seq & 1) || seq != __atomic_load_n(&rssi_note.seq, __ATOMIC_ACQUIRE));
+
+    if (seq == taken || !cmp_mac(mac, from)) {
+        return 0;
+    }
+    taken = seq;
+    return rssi;
+}
+
+/*
+* Inbound worker -- drains the receive ring, dispatching packets in order.
+*/
+void worker_recv(void* param) {
+    uint32_t tail = rx_ring.tail;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wheel_wait());
+
+        while (tail != __atomic_load_n(&rx_ring.head, __ATOMIC_ACQUIRE)) {
+            RxBuffer* rx = rx_ring.slot[tail % RX_RING_SIZE];
+            __atomic_store_n(&rx_ring.tail, ++tail, __ATOMIC_RELEASE);
+            net_dispatch(rx);
+            rx_release(rx);
+        }
+
+        wheel_run();
+    }
+}
+
+/*
+* Store worker -- on each wake-up, writes the state handed over for NVS.  Runs
+*  below every other network task, flash writes may take milliseconds.
+*/
+void worker_store(void* param) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        store_flush();
+    }
+}
+
+/*
+* App-dispatch worker -- on each wake-up, passes everything queued for apps with
+*  a handler to that handler, one batch per app.
+*/
+void worker_apps(void* param) {
+    net_msg_t batch[INBOUND_QUEUE_SIZE];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        app_read_lock();
+        const AppSnapshot* snap = __atomic_load_n(&node.app_table.current, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < APP_HASH_SIZE; ++i) {
+            const AppQueue* app = &snap->apps[i];
+            if (app->id == 0 || app->handler == NULL)
+                continue;
+
+            int count = 0;
+            RxMessage item;
+            while (count < INBOUND_QUEUE_SIZE && xQueueReceive(app->inbound, &item, 0) == pdTRUE) {
+                batch[count].head = item.head;
+                batch[count].data = (uint8_t*)(item.head + 1);
+                batch[count].token = item.buffer;
+                count++;
+            }
+            if (count == 0)
+                continue;
+
+            app->handler(batch, count, app->ctx);
+            for (int j = 0; j < count; ++j) {
+                net_release(&batch[j]);
             }
         }
+        app_read_unlock();
+    }
+}
+
+/*
+* The dispatch method for received packets.  It does simple verification of
+*  network layer state, and determines where the packet needs to be enqueued for
+*  processing or immediately dealt with.  The caller keeps its reference to the
+*  receive buffer, messages lent to applications take their own.
+*/
+void net_dispatch(RxBuffer* rx) {
+    const uint8_t* mac = rx->mac;
+    int8_t rssi = rx->rssi;
+
+    uint8_t version = wire_open(&rx->frame, rx->len, rx->format);
+    if (!version) {
+        return;
+    }
+
+    const NetFrame* frame = &rx->frame;
+    NodeId src = frame->head.source;
+
+    // A fan-out is broadcast by our parent for several of its children, any
+    //  other listener ignores it.
+    if (frame->head.control == CONTROL_FANOUT) {
+        if (!valid_link(mac, src) || !is_upstream(src) || !fanout_unwrap(&rx->frame, node.id))
+            return;
+    }
+
+    NetFrame out = {};
+
+    switch (frame->head.control) {
+    case CONTROL_LOCATE:
+        if (node.flags & (STATE_FROZEN | STATE_UNLEASED)) break;
+
+        // There is only one circumstance in which we would respond to a LOCATE
+        //  packet.  The node must:
+        //      - have an up-stream link.
+        //      - have available entries in the link table, not counting those
+        //        reserved by other pending LINK proposals.
+        //      - have a free pending slot.
+        //      - not be on a provisional node-id, which is about to change.
+        if (has_uplink(&node.link_table) &&
+            (pending_find(src) != NULL ||
+             LINK_TABLE_SIZE - 1 - count_downlinks(&node.link_table) - pending_count() > 0) &&
+            pending_add(src, mac) == 0) {
+            // Enqueue the LINK packet, the slot is reserved until it is confirmed.
+            out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+            out.head.source = node.id;
+            out.head.destination = src;
+            out.head.control = CONTROL_LINK;
+            out.head.reserved[RES_IDENT] = frame->head.reserved[RES_IDENT];
+            link_hints(&out);
+
+            net_send_raw(&out);
+        }
+        break;
+
+    case CONTROL_BEACON:
+        // Only of interest while unlinked and not already joining some other way.
+        if (node.isRoot || has_uplink(&node.link_table) ||
+            (node.flags & (STATE_FROZEN | STATE_LOCATING | STATE_DIRECT | STATE_ORPHAN))) {
+            break;
+        }
+        if (!has_hints(frame, version) || frame->contents[HINT_SLOTS] == 0)
+            break;
+
+        beacon_heard(mac, src, rssi, frame->contents);
         break;
 
     case CONTROL_LINK:
@@ -443,28 +1048,36 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
         //  linkage we proposed in response to _their_ LOCATE.
         if (node.flags & STATE_LOCATING && frame->head.reserved[RES_IDENT] == node.loc_ident) {
             if (node.loc_count < LOCATE_SIZE) {
-                node.loc_response[node.loc_count].id = src;
-                memcpy(node.loc_response[node.loc_count].mac, mac, 6);
+                Proposal* p = &node.loc_response[node.loc_count];
+                p->id = src;
+                memcpy(p->mac, mac, 6);
+                p->rssi = rssi;
+
+                if (has_hints(frame, version)) {
+                    p->hops = frame->contents[HINT_HOPS];
+                    p->slots = frame->contents[HINT_SLOTS];
+                    p->load = frame->contents[HINT_LOAD];
+                }
+                else {
+                    p->hops = HOPS_UNKNOWN;
+                }
                 node.loc_count++;
             }
         }
-        else if (node.flags & STATE_PENDING_LINK) {
+        else {
             // Verify the MAC address to ensure the node we proposed linkage to is
             //  the node which as responded to us!
-            if (!cmp_mac(mac, node.pending_mac)) {
-                break;
-            }
-            if (src != node.pending_id) {
+            PendingLink* pending = pending_find(src);
+            if (pending == NULL || !cmp_mac(mac, pending->mac)) {
                 break;
             }
 
             ESP_LOGI(TAG, "Added down-stream link 0x%02X", src);
 
-            esp_timer_stop(node.pending_timer);
-            node.flags &= ~(STATE_PENDING_LINK);
-            form_downlink(&node.link_table, mac, src);
-            memset(node.pending_mac, 0, 6);
-            node.pending_id = 0;
+            pending->id = 0;
+            if (form_downlink(&node.link_table, mac, src) == 0) {
+                credit_grant(find_entry(src));
+            }
         }
         break;
 
@@ -477,28 +1090,56 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
         // Two possible valid cases for STATUS packets received.  Either we have
         //  already requested a STATUS from the upstream node and this is a response,
         //  or this is a request from a down-stream node which we should respond to.
-        if (node.flags & STATE_UPLINK_STATUS && is_upstream(src)) {
-            // Up-stream STATUS response detected.
+        if (is_upstream(src)) {
+            // Up-stream STATUS response detected; other traffic from the parent
+            //  may already have answered the check, its hints are still news.
             node.flags &= ~(STATE_UPLINK_STATUS);
-            esp_timer_stop(node.status_timer);
+            wheel_stop(&node.status_timer);
+
+            // Keep our depth current, the parent may have moved.  Its free slots
+            //  are noted as they would be without us, like in its LINK proposal;
+            //  a full parent reports none.
+            if (has_hints(frame, version)) {
+                node.depth = frame->contents[HINT_HOPS] + 1;
+                node.parent.hops = frame->contents[HINT_HOPS];
+                node.parent.slots = frame->contents[HINT_SLOTS] + 1;
+                node.parent.load = frame->contents[HINT_LOAD];
+            }
+            if (rssi != 0) {
+                node.parent.rssi = rssi;
+            }
+
+            // Parents doing flow control repeat our credit, in case a grant was lost.
+            LinkEntry* up = &node.link_table.entry[LINK_UP];
+            if (up->credited && (int8_t)(frame->head.reserved[RES_CREDIT] - up->credit_limit) > 0) {
+                while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+                    // Spin..
+                }
+                up->credit_limit = frame->head.reserved[RES_CREDIT];
+                uplink_release();
+                xSemaphoreGive(node.up_lock);
+            }
+
+            if (node.flags & STATE_MIGRATING) {
+                migrate_done();
+            }
         }
         else if (is_downstream(src)) {
-            // Down-stream STATUS request detected.
-            
-            // Restart the link decay timer for the link.
+            // Down-stream STATUS request detected.  Like any frame from the
+            //  child it keeps the link from decaying, see timer_cb_downstream(..).
             LinkEntry* link = find_entry(src);
-            esp_timer_stop(link->timer);
-            if (esp_timer_start_once(link->timer, TIMEOUT_LINK_DECAY) != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to restart down-stream link decay timer.");
-                break;
-            }
+
+            // Frames lost on the air can leave a child short of the point where
+            //  we would grant more, so top it up with every check.
+            credit_grant(link);
 
             // Respond with a STATUS packet.
             out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
             out.head.source = node.id;
             out.head.destination = src;
             out.head.control = CONTROL_STATUS;
-            out.head.checksum = pak_checksum(&out);
+            out.head.reserved[RES_CREDIT] = link->credit_limit;
+            link_hints(&out);
 
             // TODO: Replace with queue mechanism.
             net_send_raw(&out);
@@ -519,28 +1160,28 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
             out.head.control = CONTROL_MAP;
             out.head.reserved[RES_ORIGIN] = node.id;
             out.head.reserved[RES_UPSTREAM] = src;
-            out.head.checksum = pak_checksum(&out);
             net_send_raw(&out);
 
             // Forward original packet downstream.
-            memcpy(&out, frame, sizeof(NetFrame));
-            out.head.source = node.id;
-            for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-                if (i == LINK_UP)
-                    continue;
-                if (node.link_table.usage & (1ul << i)) {
-                    out.head.destination = node.link_table.entry[i].id;
-                    out.head.checksum = pak_checksum(&out);
-                    net_send_raw(&out);
-                }
-            }
+            NetFrame* fwd = frame_alloc(CLASS_CONTROL);
+            if (fwd == NULL)
+                break;
+            memcpy(fwd, frame, sizeof(NetFrame));
+            fwd->head.source = node.id;
+            net_send_downlinks(fwd);
+            frame_release(fwd);
         }
-        else if (is_downstream(src) && !node.isRoot) {
-            memcpy(&out, frame, sizeof(NetFrame));
-            out.head.source = node.id;
-            out.head.destination = node.link_table.entry[LINK_UP].id;
-            out.head.checksum = pak_checksum(&out);
-            net_send_raw(&out);
+        else if (is_downstream(src)) {
+            // Responses also tell us where their origin sits below us.
+            route_learn(frame->head.reserved[RES_ORIGIN], src);
+
+            // An orphan has nowhere to pass the response.
+            if (!node.isRoot && has_uplink(&node.link_table)) {
+                memcpy(&out, frame, sizeof(NetFrame));
+                out.head.source = node.id;
+                out.head.destination = node.link_table.entry[LINK_UP].id;
+                net_send_raw(&out);
+            }
         }
         break;
 
@@ -563,21 +1204,15 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
 
             // Restart the link timers.
             for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-                if (node.link_table.usage & (1ul << i)) {
+                if (link_used(&node.link_table, i)) {
                     if (i == LINK_UP) {
                         if (!node.isRoot) {
                             uint64_t wnd = PERIOD_UP_STATUS + (esp_random() % WINDOW_UP_STATUS);
-                            if (esp_timer_start_once(node.link_table.entry[i].timer, wnd) != ESP_OK) {
-                                ESP_LOGE(TAG, "Failed to restart up-stream status timer after freeze.");
-                                return;
-                            }
+                            wheel_start(&node.link_table.entry[i].timer, wnd);
                         }
                     }
                     else {
-                        if (esp_timer_start_once(node.link_table.entry[i].timer, TIMEOUT_LINK_DECAY) != ESP_OK) {
-                            ESP_LOGE(TAG, "Failed to restart down-stream link decay timer after freeze.");
-                            return;
-                        }
+                        wheel_start(&node.link_table.entry[i].timer, TIMEOUT_LINK_DECAY);
                     }
                 }
             }
@@ -593,12 +1228,12 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
             *       packet upstream and then FREEZE arrives before response).
             */
             node.flags &= ~(STATE_UPLINK_STATUS);
-            esp_timer_stop(node.status_timer);
+            wheel_stop(&node.status_timer);
 
             for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-                if (node.link_table.usage & (1ul << i)) {
+                if (link_used(&node.link_table, i)) {
                     if ((i == LINK_UP && !node.isRoot) || i != LINK_UP) {
-                        esp_timer_stop(node.link_table.entry[i].timer);
+                        wheel_stop(&node.link_table.entry[i].timer);
                     }
                 }
             }
@@ -606,497 +1241,2885 @@ void espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
 
         break;
 
-    case CONTROL_DEFAULT: {
-            // TODO: Re-evaluate default behaviour.  Maybe.. no default behaviour?
-            //  Let the applicates decide what packet forwarding behaviour is appropriate
-            //  for their application type.
+    case CONTROL_DEFAULT:
+        if (!is_linked(src))
+            break;
+
+        if (frame->head.reserved[RES_LENGTH] < sizeof(app_header_t) ||
+            ((const app_header_t*)frame->contents)->len > frame->head.reserved[RES_LENGTH] - sizeof(app_header_t)) {
+            break;
+        }
+
+        dispatch_app(rx, src, frame->contents);
+        break;
+
+    case CONTROL_UNICAST: {
             if (!is_linked(src))
                 break;
 
-            uint8_t app_pkt[NET_MAX_PAYLOAD + sizeof(app_header_t)];
-            memcpy(&app_pkt, frame->contents, sizeof(app_header_t) + NET_MAX_PAYLOAD);
+            if (frame->head.reserved[RES_LENGTH] < sizeof(app_header_t) ||
+                ((const app_header_t*)frame->contents)->len > frame->head.reserved[RES_LENGTH] - sizeof(app_header_t)) {
+                break;
+            }
 
-            // NOTE: This is a bit of a hack.  Encode first app header reserved byte as
-            //  0x01 if the packet came from upstream, otherwise 0x00.  This behaviour is
-            //  NOT defined in the spec and may be subject to change.
+            const app_header_t* head = (const app_header_t*)frame->contents;
+            if (is_downstream(src)) {
+                route_learn(head->reserved[APP_RES_ORIGIN], src);
+            }
+
+            if (frame->head.reserved[RES_TARGET] == node.id) {
+                deliver_app(rx, src, frame->contents);
+                break;
+            }
+
+            NetFrame* fwd = frame_alloc(CLASS_DATA);
+            if (fwd == NULL)
+                break;
+            memcpy(fwd, frame, sizeof(NetFrame));
+            fwd->head.source = node.id;
+            route_forward(fwd, src);
+            frame_release(fwd);
+            break;
+        }
+
+    case CONTROL_SUBSCRIBE: {
+            if (!is_downstream(src) || frame->head.reserved[RES_LENGTH] < sizeof(uint64_t))
+                break;
+
+            LinkEntry* child = find_entry(src);
+            memcpy(&child->interest, frame->contents, sizeof(uint64_t));
+            child->advertised = 1;
+
+            subscribe_update(0);
+            break;
+        }
+
+    case CONTROL_UNLINK: {
+            if (!is_downstream(src) || !valid_link(mac, src))
+                break;
+
+            ESP_LOGI(TAG, "Down-stream link %02X moved to another parent.", src);
 
-            ((app_header_t*)app_pkt)->reserved[0] = (is_upstream(src) ? 0x01 : 0x00);
+            LinkEntry* child = find_entry(src);
+            wheel_stop(&child->timer);
+            link_remove(&node.link_table, child - node.link_table.entry);
+
+            subscribe_update(0);
+            break;
+        }
 
-            uint16_t app_id = ((app_header_t*)app_pkt)->type;
+    case CONTROL_ROUTES: {
+            if (!is_downstream(src))
+                break;
 
-            QueueHandle_t qh = find_app(app_id);
-            if (qh != NULL) {
-                xQueueSend(qh, app_pkt, 0);
+            // Legacy frames arrive zero padded, node-id 0 is never valid.
+            int length = frame->head.reserved[RES_LENGTH];
+            for (int i = 0; i < length; ++i) {
+                if (frame->contents[i] != 0) {
+                    route_learn(frame->contents[i], src);
+                }
             }
-            else {
-                // No application registered for the app type.  Engage default behaviour.
-                if (is_upstream(src)) {
-                    net_send_down((app_header_t*)app_pkt, app_pkt + sizeof(app_header_t));
+
+            if (!node.isRoot && has_uplink(&node.link_table)) {
+                NetFrame* fwd = frame_alloc(CLASS_CONTROL);
+                if (fwd == NULL)
+                    break;
+                memcpy(fwd, frame, sizeof(NetFrame));
+                fwd->head.source = node.id;
+                net_send_frame(fwd, node.link_table.entry[LINK_UP].id);
+                frame_release(fwd);
+            }
+            break;
+        }
+
+    case CONTROL_MOVED: {
+            if (!is_upstream(src))
+                break;
+            if (!has_hints(frame, version))
+                break;
+
+            uint8_t depth = frame->contents[HINT_HOPS] + 1;
+            node.parent.hops = frame->contents[HINT_HOPS];
+            if (depth == node.depth)
+                break;
+
+            // Pass our own new depth on down.
+            node.depth = depth;
+            send_moved();
+            break;
+        }
+
+    case CONTROL_LEASE: {
+            if (frame->head.reserved[RES_LENGTH] < LEASE_SIZE)
+                break;
+
+            NodeId target = frame->head.reserved[RES_TARGET];
+            if (target == 0) {
+                // Request from below: remember the way back, grant at the root.
+                if (!is_downstream(src))
+                    break;
+                route_learn(frame->head.reserved[RES_ORIGIN], src);
+
+                NetFrame* fwd = frame_alloc(CLASS_CONTROL);
+                if (fwd == NULL)
+                    break;
+                memcpy(fwd, frame, sizeof(NetFrame));
+                fwd->head.source = node.id;
+                if (node.isRoot) {
+                    fwd->head.reserved[RES_TARGET] = frame->head.reserved[RES_ORIGIN];
+                    fwd->contents[LEASE_ID] = lease_grant(frame->contents + LEASE_MAC, frame->contents[LEASE_ID]);
+                    lease_forward(fwd);
                 }
-                else {
-                    net_send_up((app_header_t*)app_pkt, app_pkt + sizeof(app_header_t));
+                else if (has_uplink(&node.link_table)) {
+                    net_send_frame(fwd, node.link_table.entry[LINK_UP].id);
                 }
+                frame_release(fwd);
             }
+            else {
+                if (!is_upstream(src))
+                    break;
+
+                uint8_t own[6];
+                esp_read_mac(own, ESP_MAC_WIFI_STA);
+                if (target == node.id && cmp_mac(frame->contents + LEASE_MAC, own)) {
+                    lease_adopt(frame->contents[LEASE_ID]);
+                    break;
+                }
 
+                NetFrame* fwd = frame_alloc(CLASS_CONTROL);
+                if (fwd == NULL)
+                    break;
+                memcpy(fwd, frame, sizeof(NetFrame));
+                fwd->head.source = node.id;
+                lease_forward(fwd);
+                frame_release(fwd);
+            }
             break;
         }
-    }
-}
 
-void exec_blackout() {
-    NetFrame out = {};
-    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
-    out.head.source = node.id;
-    out.head.control = CONTROL_BLACKOUT;
+    case CONTROL_CREDIT: {
+            if (!is_upstream(src) || !valid_link(mac, src))
+                break;
 
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (i == LINK_UP)
-            continue;
+            LinkEntry* up = &node.link_table.entry[LINK_UP];
+            while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+                // Spin..
+            }
+            // Grants only ever grow, a late one is ignored.
+            if (!up->credited || (int8_t)(frame->head.reserved[RES_CREDIT] - up->credit_limit) > 0) {
+                up->credited = 1;
+                up->credit_limit = frame->head.reserved[RES_CREDIT];
+            }
+            uplink_release();
+            xSemaphoreGive(node.up_lock);
+            break;
+        }
 
-        if (node.link_table.usage & (1ul << i)) {
-            out.head.destination = node.link_table.entry[i].id;
-            out.head.checksum = pak_checksum(&out);
-            net_send_raw(&out);
+    case CONTROL_BUNDLE: {
+            if (!is_linked(src))
+                break;
+
+            // Unpack each message in turn, stopping at the first one which does
+            //  not fit the frame.
+            int length = frame->head.reserved[RES_LENGTH];
+            int offset = 0;
+            while (offset + (int)sizeof(app_header_t) <= length) {
+                const app_header_t* head = (const app_header_t*)(frame->contents + offset);
+                int size = sizeof(app_header_t) + head->len;
+                if (offset + size > length) {
+                    ESP_LOGW(TAG, "Truncated message in bundle from 0x%02X.", src);
+                    break;
+                }
+                dispatch_app(rx, src, frame->contents + offset);
+                offset += size;
+            }
+            break;
         }
     }
 
-    ESP_LOGI(TAG, "Blacking out...");
-    // NOTE: It would generally be in very bad form to delay(..) within a function
-    //  used by timer / esp-now callbacks.  However, since our next action is to
-    //  restart the device, we can get away with this here for now.
-    vTaskDelay(2000 / portTICK_RATE_MS);
-    esp_restart();
-}
+    // A frame from a linked peer tells us which wire format it understands.
+    //  One addressed to us (a fan-out listing us is, once unwrapped) also tells
+    //  us it is alive and still holds the link: the up-stream check is answered,
+    //  and down-stream links do not decay.  Broadcast BEACON and LOCATE frames
+    //  are sent whether or not it does.  Only a new parent must answer the
+    //  STATUS itself.
+    LinkEntry* link = find_entry(src);
+    if (link != NULL && link->key == mac_pack(mac)) {
+        uint8_t control = frame->head.control;
+        if (frame->head.destination == node.id &&
+            control != CONTROL_BEACON && control != CONTROL_LOCATE) {
+            link->last_rx = esp_timer_get_time();
+            if ((node.flags & STATE_UPLINK_STATUS) && !(node.flags & STATE_MIGRATING) && is_upstream(src)) {
+                node.flags &= ~(STATE_UPLINK_STATUS);
+                wheel_stop(&node.status_timer);
+            }
+        }
 
-/*
-* Predicate method.  Returns non-zero if true.
-*/
-int has_uplink(const LinkTable* table) {
-    assert(table != NULL);
+        // Only a peer speaking the compact format can send it.  The CAPS bit is
+        //  taken only from frames the peer builds itself: legacy relays copy
+        //  a forwarded frame whole, CAPS bit of its originator included.
+        if (version == NETWORK_VERSION_COMPACT ||
+            ((control == CONTROL_LINK || control == CONTROL_STATUS) &&
+                (frame->head.reserved[RES_CAPS] & CAPS_COMPACT))) {
+            link->version = NETWORK_VERSION_COMPACT;
+        }
+        route_learn(src, src);
 
-    if (table->usage & (1ul << LINK_UP)) {
-        return 1;
+        if (is_downstream(src) &&
+            (control == CONTROL_DEFAULT || control == CONTROL_BUNDLE || control == CONTROL_UNICAST)) {
+            credit_received(link, frame->head.reserved[RES_CREDIT]);
+        }
     }
-    return 0;
 }
 
 /*
-* Method checks link table.  If there are available down-stream entries, it
-*  returns the index associated with that entry.  Returns negative if there
-*  are no down-stream links available.
+* Method delivers one application message (header and payload) received from a
+*  linked node, or forwards it if no application is registered for its type.
 */
-int has_available_downlinks(const LinkTable* table) {
-    assert(table != NULL);
+void dispatch_app(RxBuffer* rx, NodeId src, const uint8_t* pkt) {
+    // TODO: Re-evaluate default behaviour.  Maybe.. no default behaviour?
+    //  Let the applicates decide what packet forwarding behaviour is appropriate
+    //  for their application type.
+    const app_header_t* head = (const app_header_t*)pkt;
+
+    if (is_downstream(src)) {
+        route_learn(head->reserved[APP_RES_ORIGIN], src);
+    }
 
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (i == LINK_UP) {
-            continue;
+    if (deliver_app(rx, src, pkt) != 0) {
+        // No application registered for the app type.  Engage default behaviour.
+        if (is_upstream(src)) {
+            send_down(head, pkt + sizeof(app_header_t), head->reserved[APP_RES_FLAGS]);
+        }
+        else {
+            send_up(head, pkt + sizeof(app_header_t), head->reserved[APP_RES_ORIGIN]);
         }
-        if (!(table->usage & (1ul << i)))
-            return i;
     }
-    return -1;
 }
 
 /*
-* Method returns 0 on success, non-zero otherwise.
+* Method queues one application message, inside the receive buffer 'rx', for
+*  its application.
+* Returns 0 if the application is registered (even if the message had to be
+*  dropped), non-zero otherwise.
 */
-int form_uplink(LinkTable* table, const uint8_t* mac, NodeId id) {
-    assert(table != NULL);
-    assert(mac != NULL);
-    assert(id > 0);
-
-    if (table->usage & (1ul << LINK_UP)) {
-        ESP_LOGE(TAG, "Up-stream virtual link already established.");
-        return -1;
-    }
+int deliver_app(RxBuffer* rx, NodeId src, const uint8_t* pkt) {
+    const app_header_t* head = (const app_header_t*)pkt;
+
+    // The read section covers the send, so an unregister cannot delete the queue
+    //  underneath us.
+    app_read_lock();
+    const AppQueue* app = app_lookup(head->type);
+    QueueHandle_t qh = (app != NULL ? app->inbound : NULL);
+    if (qh != NULL) {
+        // The message is lent where the radio's bytes were copied.  Only one
+        //  off a word boundary, later in a bundle, is copied to a buffer of
+        //  its own, to keep the payload castable.
+        RxBuffer* buffer = rx;
+        app_header_t* msg = (app_header_t*)pkt;
+        if (((uintptr_t)pkt & 3) != 0) {
+            buffer = rx_alloc();
+            if (buffer != NULL) {
+                msg = (app_header_t*)buffer->frame.contents;
+                memcpy(msg, pkt, sizeof(app_header_t) + head->len);
+            }
+        }
+        else {
+            rx_retain(buffer);
+        }
 
-    table->usage |= (1ul << LINK_UP);
-    table->entry[LINK_UP].id = id;
-    memcpy(table->entry[LINK_UP].mac, mac, 6);
+        if (buffer != NULL) {
+            // NOTE: This is a bit of a hack.  Encode first app header reserved byte as
+            //  0x01 if the packet came from upstream, otherwise 0x00.  This behaviour is
+            //  NOT defined in the spec and may be subject to change.
+            msg->reserved[APP_RES_DIRECTION] = (is_upstream(src) ? 0x01 : 0x00);
 
-    uint64_t wnd = PERIOD_UP_STATUS + (esp_random() % WINDOW_UP_STATUS);
-    if (esp_timer_start_once(table->entry[LINK_UP].timer, wnd) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start up-stream status timer.");
-        return -2;
+            RxMessage item = { buffer, msg };
+            if (xQueueSend(qh, &item, 0) != pdTRUE) {
+                rx_release(buffer);
+            }
+            else if (app->handler != NULL) {
+                xTaskNotifyGive(node.svc_apps);
+            }
+        }
+        else {
+            rx_ring.starved++;
+        }
     }
+    app_read_unlock();
 
-    return 0;
+    return (qh != NULL ? 0 : -1);
 }
 
 /*
-* Method returns 0 on success, non-zero otherwise.
+* Method records that node-id sits in the subtree below the down-stream link
+*  'via'.  Ignores anything not learned through a down-stream link.
 */
-int form_downlink(LinkTable* table, const uint8_t* mac, NodeId id) {
-    assert(table != NULL);
-    assert(mac != NULL);
-    assert(id > 0);
-
-    int x = has_available_downlinks(table);
-    if (x < 0) {
-        ESP_LOGE(TAG, "Cannot form down-stream link, link table full.");
-        return -1;
-    }
-
-    table->usage |= (1ul << x);
-    table->entry[x].id = id;
-    memcpy(table->entry[x].mac, mac, 6);
-
-    if (esp_timer_start_once(table->entry[x].timer, TIMEOUT_LINK_DECAY) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to start down-stream link decay timer.");
-        return -2;
-    }
+void route_learn(NodeId id, NodeId via) {
+    if (id == 0 || id == node.id || id == link_broadcast.id || !is_downstream(via))
+        return;
 
-    return 0;
+    routes[id].via = via;
+    routes[id].seen = esp_timer_get_time();
 }
 
 /*
-* Method returns zero if packet is obviously invalid or malformed.
+* Method returns the down-stream link towards node-id, or 0 if the route is
+*  unknown, stale, or its link has gone.
 */
-int valid_packet(const uint8_t* mac, const uint8_t* data, int len) {
-    const NetFrame* frame = (const NetFrame*)data;
-
-
-    if (len != sizeof(NetFrame)) {
-        return 0;
-    }
-    
-    if (frame->head.version != (NETWORK_TYPE | NETWORK_VERSION)) {
+NodeId route_lookup(NodeId id) {
+    const RouteEntry* route = &routes[id];
+    if (route->via == 0 || esp_timer_get_time() - route->seen > TIMEOUT_ROUTE) {
         return 0;
     }
+    return (is_downstream(route->via) ? route->via : 0);
+}
 
-    if (frame->head.checksum != pak_checksum(frame)) {
+/*
+* Method passes a unicast frame one hop on, having arrived from src (0 if
+*  it originates here): down the known route, else up towards the root, which
+*  floods it down as a last resort.  Frames are never sent back up-stream.
+*/
+void route_forward(NetFrame* frame, NodeId src) {
+    NodeId via = route_lookup(frame->head.reserved[RES_TARGET]);
+    if (via != 0 && via != src) {
+        net_send_frame(frame, via);
+    }
+    else if ((src == 0 || !is_upstream(src)) && !node.isRoot && has_uplink(&node.link_table)) {
+        while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+            // Spin..
+        }
+        uplink_send(frame);
+        xSemaphoreGive(node.up_lock);
+    }
+    else {
+        // Only subtrees running the app can hold a target that wants it.
+        net_send_subscribed(frame, ((const app_header_t*)frame->contents)->type,
+            ((const app_header_t*)frame->contents)->reserved[APP_RES_FLAGS]);
+    }
+}
+
+/*
+* Method tells the nodes up-stream, up to the root, which node-ids are now
+*  reached through this node: itself and every node with a route below it.
+*  Sent after moving to another parent, so routes learned along the old path
+*  are overridden where the two paths meet.
+*/
+void route_announce() {
+    uint8_t ids[255];
+    int count = 0;
+    for (int id = 1; id < 256; ++id) {
+        if (id == node.id || route_lookup(id) != 0) {
+            ids[count++] = id;
+        }
+    }
+
+    // Kept to the legacy contents size, the parent may be an older node.
+    for (int i = 0; i < count; i += LEGACY_CONTENTS) {
+        NetFrame* out = frame_alloc(CLASS_CONTROL);
+        if (out == NULL)
+            return;
+
+        int n = (count - i < LEGACY_CONTENTS ? count - i : LEGACY_CONTENTS);
+        out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        out->head.source = node.id;
+        out->head.control = CONTROL_ROUTES;
+        memcpy(out->contents, ids + i, n);
+        out->head.reserved[RES_LENGTH] = n;
+        net_send_frame(out, node.link_table.entry[LINK_UP].id);
+        frame_release(out);
+    }
+}
+
+void exec_blackout() {
+    NetFrame* out = frame_alloc(CLASS_CONTROL);
+    if (out != NULL) {
+        out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        out->head.source = node.id;
+        out->head.control = CONTROL_BLACKOUT;
+        net_send_downlinks(out);
+        frame_release(out);
+    }
+
+    ESP_LOGI(TAG, "Blacking out...");
+    // NOTE: It would generally be in very bad form to delay(..) within a function
+    //  used by timer / esp-now callbacks.  However, since our next action is to
+    //  restart the device, we can get away with this here for now.
+    vTaskDelay(2000 / portTICK_RATE_MS);
+    esp_restart();
+}
+
+/*
+* Predicate method.  Returns non-zero if true.
+*/
+int has_uplink(const LinkTable* table) {
+    assert(table != NULL);
+
+    return link_used(table, LINK_UP);
+}
+
+/*
+* Method returns the number of down-stream links in use.
+*/
+int count_downlinks(const LinkTable* table) {
+    assert(table != NULL);
+
+    int count = 0;
+    for (int w = 0; w < LINK_WORDS; ++w) {
+        uint32_t used = table->usage[w];
+        if (w == LINK_UP / 32) {
+            used &= ~(1ul << (LINK_UP % 32));
+        }
+        count += __builtin_popcount(used);
+    }
+    return count;
+}
+
+/*
+* Method fills in this node's link hints as the contents of a frame, telling a
+*  joining node or a child how good a parent we are.
+*/
+void link_hints(NetFrame* frame) {
+    uint8_t* hints = frame->contents;
+    uint32_t waiting = uxQueueMessagesWaiting(outbound[CLASS_DATA].queue) + deferred_count;
+
+    hints[HINT_HOPS] = node.depth;
+    hints[HINT_SLOTS] = LINK_TABLE_SIZE - 1 - count_downlinks(&node.link_table);
+    if (waiting > outbound[CLASS_DATA].depth) {
+        waiting = outbound[CLASS_DATA].depth;
+    }
+    hints[HINT_LOAD] = waiting * 255 / outbound[CLASS_DATA].depth;
+
+    frame->head.reserved[RES_LENGTH] = HINT_SIZE;
+    frame->head.reserved[RES_CAPS] |= CAPS_HINTS;
+}
+
+/*
+* Method tells whether a received frame carries link hints.  Compact frames
+*  carry their true length, legacy ones are zero padded and so flag their
+*  hints with CAPS_HINTS; older nodes send none.
+*/
+int has_hints(const NetFrame* frame, uint8_t version) {
+    if (version == NETWORK_VERSION_COMPACT) {
+        return (frame->head.reserved[RES_LENGTH] >= HINT_SIZE);
+    }
+    return (frame->head.reserved[RES_CAPS] & CAPS_HINTS) != 0;
+}
+
+/*
+* Method returns the cost of joining through a proposing node, lower is better.
+*  Each hop to the root, a weak signal, a busy outbound queue and each child
+*  the node already has count against it.
+*/
+int parent_cost(const Proposal* p) {
+    int rssi = (p->rssi != 0 ? p->rssi : RSSI_UNKNOWN);
+    int cost = p->hops * COST_HOP + p->load * COST_LOAD / 255;
+    if (rssi < RSSI_GOOD) {
+        cost += (RSSI_GOOD - rssi) * COST_RSSI;
+    }
+    if (p->slots != 0) {
+        cost += (LINK_TABLE_SIZE - 1 - p->slots) * COST_SLOT;
+    }
+    return cost;
+}
+
+/*
+* Method weighs the proposals from a re-optimisation LOCATE against the current
+*  parent, and moves to the cheapest if it is cheaper by REOPT_MARGIN or more.
+*  Only nodes closer to the root than this node are considered, which rules out
+*  its own descendants.
+* Returns non-zero if the node is moving.
+*/
+int reopt_choose() {
+    // The current parent's free slots are kept as they would be without this
+    //  node, so it compares fairly with the others.
+    int cost = parent_cost(&node.parent);
+
+    int x = -1;
+    int best = cost - REOPT_MARGIN + 1;
+    for (uint32_t i = 0; i < node.loc_count; ++i) {
+        const Proposal* p = &node.loc_response[i];
+        if (p->id == node.link_table.entry[LINK_UP].id || is_downstream(p->id) ||
+            p->slots == 0 || p->hops >= node.depth) {
+            continue;
+        }
+
+        int c = parent_cost(p);
+        if (c < best) {
+            best = c;
+            x = i;
+        }
+    }
+
+    if (x < 0) {
+        uint64_t wnd = PERIOD_REOPT + (esp_random() % WINDOW_REOPT);
+        wheel_start(&node.reopt_timer, wnd);
         return 0;
     }
 
+    ESP_LOGI(TAG, "Moving from parent 0x%02X (cost %d) to 0x%02X (cost %d)",
+        node.parent.id, cost, node.loc_response[x].id, best);
+    migrate_uplink(&node.loc_response[x]);
     return 1;
 }
+
 /*
-* Method checks whether the (MAC, node-id) pair matches an existing link in
-*  the link table.
+* Method moves the up-stream link to the proposing node (make), keeping the old
+*  parent linked on its side until the new one has answered a STATUS check, see
+*  migrate_done(..) (break).
 */
-int valid_link(const uint8_t* mac, NodeId id) {
+void migrate_uplink(const Proposal* p) {
+    LinkEntry* up = &node.link_table.entry[LINK_UP];
+
+    node.former = node.parent;
+    memcpy(node.former.mac, up->mac, 6);
+    node.former.id = up->id;
+
+    wheel_stop(&up->timer);
+    link_remove(&node.link_table, LINK_UP);
+    form_uplink(&node.link_table, p->mac, p->id);
+    node.parent = *p;
+    node.flags |= STATE_MIGRATING;
+
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = p->id;
+    out.head.control = CONTROL_LINK;
+    out.head.reserved[RES_IDENT] = node.loc_ident;
+    net_send_raw(&out);
+
+    // Check the new parent straight away, rather than after a full period.
+    wheel_stop(&node.link_table.entry[LINK_UP].timer);
+    timer_cb_upstream((void*)LINK_UP);
+}
+
+/*
+* Method completes a move once the new parent has answered: the old parent is
+*  released, the nodes up-stream learn the new routes to this subtree, and the
+*  nodes below their new depth.
+*/
+void migrate_done() {
+    node.flags &= ~(STATE_MIGRATING);
+    node.depth = node.parent.hops + 1;
+
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = node.former.id;
+    out.head.control = CONTROL_UNLINK;
+    net_send_raw(&out);
+
+    route_announce();
+    send_moved();
+    parent_save(&node.parent);
+
+    ESP_LOGI(TAG, "Moved to parent 0x%02X, depth %u", node.parent.id, node.depth);
+}
+
+/*
+* Method links up to the proposing node: confirms its proposal and advertises
+*  our interest behind the LINK, so the parent has formed the link by the time
+*  it sees that.
+*/
+void uplink_adopt(const Proposal* p) {
+    form_uplink(&node.link_table, p->mac, p->id);
+    node.parent = *p;
+    node.depth = p->hops + 1;
+
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = p->id;
+    out.head.control = CONTROL_LINK;
+    out.head.reserved[RES_IDENT] = node.loc_ident;
+
+    net_send_raw(&out);
+
+    subscribe_update(1);
+    parent_save(p);
+
+    // Ask for (or confirm) our node-id with every new parent, it routes the answer.
+    if (node.dynamic_id) {
+        lease_request();
+    }
+}
+
+/*
+* Method tells the down-stream links our depth (link hints) has changed.
+*/
+void send_moved() {
+    NetFrame* out = frame_alloc(CLASS_CONTROL);
+    if (out == NULL)
+        return;
+
+    out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out->head.source = node.id;
+    out->head.control = CONTROL_MOVED;
+    link_hints(out);
+    net_send_downlinks(out);
+    frame_release(out);
+}
+
+/*
+* Method drops the up-stream link after it failed a STATUS check, and starts
+*  looking for another parent.  Down-stream links are kept, their up-stream
+*  traffic is held (orphan_hold(..)) until then.
+*/
+void orphan_begin() {
+    ESP_LOGW(TAG, "Lost parent 0x%02X, looking for another.", node.parent.id);
+
+    LinkEntry* up = &node.link_table.entry[LINK_UP];
+    wheel_stop(&up->timer);
+    link_remove(&node.link_table, LINK_UP);
+
+    node.flags &= ~(STATE_UPLINK_STATUS);
+    node.flags |= STATE_ORPHAN;
+    node.orphan_tries = 0;
+
+    timer_cb_join(NULL);
+}
+
+/*
+* Method picks a new parent from the proposals while orphaned, or schedules the
+*  next attempt.  Our own subtree still has its up-stream link (us), so nodes
+*  we route to, and any not closer to the root than we were, are passed over.
+*  After ORPHAN_ATTEMPTS the node blacks out after all.
+* Returns non-zero if a parent was found.
+*/
+int orphan_choose() {
+    int x = -1;
+    int best = 0;
+    for (uint32_t i = 0; i < node.loc_count; ++i) {
+        const Proposal* p = &node.loc_response[i];
+        if (is_downstream(p->id) || route_lookup(p->id) != 0 ||
+            p->slots == 0 || p->hops >= node.depth) {
+            continue;
+        }
+
+        int c = parent_cost(p);
+        if (x < 0 || c < best) {
+            best = c;
+            x = i;
+        }
+    }
+
+    if (x < 0) {
+        if (++node.orphan_tries >= ORPHAN_ATTEMPTS) {
+            ESP_LOGE(TAG, "No new parent found.");
+            exec_blackout();
+            return 0;
+        }
+
+        uint64_t wnd = ORPHAN_RETRY + (esp_random() % TIMEOUT_LOCATE);
+        wheel_start(&node.join_timer, wnd);
+        return 0;
+    }
+
+    uplink_adopt(&node.loc_response[x]);
+    node.flags &= ~(STATE_ORPHAN);
+    node.orphaned++;
+
+    while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    uplink_release();
+    xSemaphoreGive(node.up_lock);
+    route_announce();
+    send_moved();
+
+    ESP_LOGI(TAG, "Adopted by parent 0x%02X (cost %d), depth %u", node.parent.id, best, node.depth);
+    return 1;
+}
+
+/*
+* Method holds an up-stream frame while orphaned, dropping the oldest held if
+*  the buffer is full.
+*/
+void orphan_hold(NetFrame* frame) {
+    NetFrame* oldest = NULL;
+    if (uxQueueSpacesAvailable(node.held_queue) == 0 &&
+        xQueueReceive(node.held_queue, &oldest, 0) == pdTRUE) {
+        frame_release(oldest);
+        node.orphan_lost++;
+    }
+
+    frame_retain(frame);
+    if (xQueueSend(node.held_queue, &frame, 0) != pdTRUE) {
+        frame_release(frame);
+        node.orphan_lost++;
+    }
+}
+
+/*
+* Method sends held frames to the parent, oldest first, while it grants credit.
+* NOTE: The caller must hold the up-stream lock.
+*/
+void uplink_release() {
+    if (node.flags & STATE_ORPHAN || !has_uplink(&node.link_table))
+        return;
+
+    LinkEntry* up = &node.link_table.entry[LINK_UP];
+    NetFrame* frame = NULL;
+    int released = 0;
+    while ((!up->credited || (int8_t)(up->credit_limit - up->credit_seq) > 0) &&
+           xQueueReceive(node.held_queue, &frame, 0) == pdTRUE) {
+        frame->head.destination = up->id;
+        frame->head.reserved[RES_CREDIT] = ++up->credit_seq;
+        net_send_frame(frame, frame->head.destination);
+        frame_release(frame);
+        released++;
+    }
+
+    if (released) {
+        xSemaphoreGive(node.credit_ready);
+    }
+}
+
+/*
+* Method sends a data frame to the parent if it grants credit, else holds it
+*  behind any frames already held.  While orphaned the oldest held frame makes
+*  way instead, see orphan_hold(..).
+* NOTE: The caller must hold the up-stream lock.
+* Returns 0 if sent or held, non-zero if dropped.
+*/
+int uplink_send(NetFrame* frame) {
+    if (node.flags & STATE_ORPHAN) {
+        orphan_hold(frame);
+        return 0;
+    }
+
+    uplink_release();
+
+    LinkEntry* up = &node.link_table.entry[LINK_UP];
+    if (uxQueueMessagesWaiting(node.held_queue) == 0 &&
+        (!up->credited || (int8_t)(up->credit_limit - up->credit_seq) > 0)) {
+        frame->head.destination = up->id;
+        frame->head.reserved[RES_CREDIT] = ++up->credit_seq;
+        return net_send_frame(frame, frame->head.destination);
+    }
+
+    frame_retain(frame);
+    if (xQueueSend(node.held_queue, &frame, 0) != pdTRUE) {
+        frame_release(frame);
+        node.throttled++;
+        credit_request();
+        return -1;
+    }
+    credit_request();
+    return 0;
+}
+
+/*
+* Method returns non-zero if an up-stream message would be sent or held now,
+*  zero if it would be dropped for lack of credit.
+*/
+int uplink_ready() {
+    if (node.flags & STATE_ORPHAN || uxQueueSpacesAvailable(node.held_queue) > 0)
+        return 1;
+
+    const LinkEntry* up = &node.link_table.entry[LINK_UP];
+    return (uxQueueMessagesWaiting(node.held_queue) == 0 &&
+        (!up->credited || (int8_t)(up->credit_limit - up->credit_seq) > 0));
+}
+
+/*
+* Method returns non-zero if we hold frames for the parent and have used up all
+*  the credit it granted.
+*/
+int uplink_starved() {
+    const LinkEntry* up = &node.link_table.entry[LINK_UP];
+    return (up->credited && (int8_t)(up->credit_limit - up->credit_seq) <= 0 &&
+        uxQueueMessagesWaiting(node.held_queue) > 0);
+}
+
+/*
+* Method asks the parent for credit while we are starved, at most once every
+*  PERIOD_CREDIT.  A grant is sent once only, so if it was lost the parent
+*  would never hear from us again; its STATUS response repeats our credit.
+* NOTE: The caller must hold the up-stream lock.
+*/
+void credit_request() {
+    if (node.flags & STATE_ORPHAN || !has_uplink(&node.link_table) || !uplink_starved())
+        return;
+
+    int64_t now = esp_timer_get_time();
+    if (now - node.credit_asked < PERIOD_CREDIT)
+        return;
+    node.credit_asked = now;
+
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = node.link_table.entry[LINK_UP].id;
+    out.head.control = CONTROL_STATUS;
+
+    net_send_raw(&out);
+}
+
+/*
+* Method accounts for a data frame from a child, numbered seq by the child, and
+*  grants more credit once half of the last grant is used up.  Numbering by the
+*  child keeps frames lost on the air from eating into its credit.
+*/
+void credit_received(LinkEntry* link, uint8_t seq) {
+    link->credit_seq = seq;
+    if ((int8_t)(link->credit_limit - seq) <= CREDIT_WINDOW / 2) {
+        credit_grant(link);
+    }
+}
+
+/*
+* Method extends a child's credit by its share of the room we have for
+*  up-stream traffic, see credit_window(..).  With no room the child is marked
+*  starved and retried every PERIOD_CREDIT.
+*/
+void credit_grant(LinkEntry* link) {
+    int window = credit_window();
+    if (window == 0) {
+        link->starved = 1;
+        wheel_start(&node.credit_timer, PERIOD_CREDIT);
+        return;
+    }
+    link->starved = 0;
+
+    uint8_t limit = link->credit_seq + window;
+    if ((int8_t)(limit - link->credit_limit) <= 0) {
+        return;
+    }
+    link->credit_limit = limit;
+
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = link->id;
+    out.head.control = CONTROL_CREDIT;
+    out.head.reserved[RES_CREDIT] = limit;
+
+    net_send_raw(&out);
+}
+
+/*
+* Method returns the data frames one child may have outstanding: the room in
+*  whatever its frames go to next (the root's receive buffers, else our data
+*  queue, or the held frames while we ourselves are out of credit), shared with
+*  the other children and our own traffic.
+*/
+int credit_window() {
+    int room = uxQueueMessagesWaiting(rx_free);
+    if (!node.isRoot) {
+        int queue = uxQueueSpacesAvailable(outbound[CLASS_DATA].queue);
+        if (uxQueueMessagesWaiting(node.held_queue) > 0) {
+            queue = uxQueueSpacesAvailable(node.held_queue);
+        }
+        if (queue < room) {
+            room = queue;
+        }
+    }
+
+    int window = room / (count_downlinks(&node.link_table) + 1);
+    if (window == 0 && room > 0) {
+        window = 1;
+    }
+    return (window < CREDIT_WINDOW ? window : CREDIT_WINDOW);
+}
+
+/*
+* TIMER CALLBACK method -- retry the grants to children left without credit.
+*/
+void timer_cb_credit(void* param) {
     for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (node.link_table.usage & (1ul << i)) {
-            int match = 1;
-            if (!cmp_mac(mac, node.link_table.entry[i].mac)) {
-                match = 0;
-            }
-            if (node.link_table.entry[i].id != id) {
-                match = 0;
-            }
-            if (match) {
-                return 1;
-            }
+        LinkEntry* link = &node.link_table.entry[i];
+        if (i != LINK_UP && link_used(&node.link_table, i) && link->starved) {
+            credit_grant(link);
+        }
+    }
+}
+
+/*
+* Method starts a warm rejoin after boot, directly to the last parent.
+* Returns 0 if started, non-zero if there is no last parent to try.
+*/
+int rejoin_begin() {
+    Proposal last;
+    if (parent_load(&last) != 0) {
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Rejoining last parent 0x%02X", last.id);
+    direct_begin(&last);
+    return 0;
+}
+
+/*
+* Method starts a direct join: LOCATE is sent straight away, to the given node
+*  only, which answers with a LINK proposal as usual.  See timer_cb_locating(..).
+*/
+void direct_begin(const Proposal* p) {
+    node.direct = *p;
+    node.direct_tries = 0;
+    node.flags |= STATE_DIRECT;
+
+    node.loc_count = 0;
+    memset(node.loc_response, 0, sizeof(node.loc_response));
+
+    wheel_stop(&node.join_timer);
+    timer_cb_join(NULL);
+}
+
+/*
+* TIMER CALLBACK method -- linked nodes with free down-stream links announce
+*  themselves, so joining nodes need not LOCATE.
+*/
+void timer_cb_beacon(void* param) {
+    int linked = (node.isRoot || has_uplink(&node.link_table));
+    int free = LINK_TABLE_SIZE - 1 - count_downlinks(&node.link_table) - pending_count();
+
+    if (linked && free > 0 && !(node.flags & (STATE_FROZEN | STATE_ORPHAN | STATE_UNLEASED))) {
+        NetFrame out = {};
+        out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        out.head.source = node.id;
+        out.head.destination = link_broadcast.id;
+        out.head.control = CONTROL_BEACON;
+        link_hints(&out);
+
+        net_send_raw(&out);
+    }
+
+    uint64_t wnd = PERIOD_BEACON + (esp_random() % WINDOW_BEACON);
+    wheel_start(&node.beacon_timer, wnd);
+}
+
+/*
+* Method records a beacon heard while unlinked.  The first one starts a window
+*  of LISTEN_BEACON, long enough to hear every parent in range once.
+*/
+void beacon_heard(const uint8_t* mac, NodeId id, int8_t rssi, const uint8_t* hints) {
+    uint32_t i = 0;
+    while (i < node.loc_count && node.loc_response[i].id != id) {
+        ++i;
+    }
+    if (i == LOCATE_SIZE) {
+        return;
+    }
+
+    Proposal* p = &node.loc_response[i];
+    p->id = id;
+    memcpy(p->mac, mac, 6);
+    p->rssi = rssi;
+    p->hops = hints[HINT_HOPS];
+    p->slots = hints[HINT_SLOTS];
+    p->load = hints[HINT_LOAD];
+    if (i == node.loc_count) {
+        node.loc_count++;
+    }
+
+    if (!(node.flags & STATE_LISTENING)) {
+        node.flags |= STATE_LISTENING;
+        wheel_stop(&node.join_timer);
+        wheel_start(&node.listen_timer, LISTEN_BEACON);
+    }
+}
+
+/*
+* TIMER CALLBACK method -- the beacon listening window has elapsed, join the
+*  cheapest parent heard directly.
+*/
+void timer_cb_listen(void* param) {
+    node.flags &= ~(STATE_LISTENING);
+    if (node.loc_count == 0 || has_uplink(&node.link_table))
+        return;
+
+    uint32_t x = 0;
+    for (uint32_t i = 1; i < node.loc_count; ++i) {
+        if (parent_cost(&node.loc_response[i]) < parent_cost(&node.loc_response[x])) {
+            x = i;
+        }
+    }
+
+    Proposal best = node.loc_response[x];
+    ESP_LOGI(TAG, "Joining 0x%02X, heard by beacon.", best.id);
+    direct_begin(&best);
+}
+
+/*
+* Method reserves a down-stream link for a LINK proposal to node-id, for
+*  TIMEOUT_PROPOSE_LINK.  A node proposed to again keeps its slot.
+* Returns 0 on success, non-zero if every pending slot is taken, or node-id is
+*  already proposed to or linked with another MAC.
+*/
+int pending_add(NodeId id, const uint8_t* mac) {
+    PendingLink* slot = pending_find(id);
+    int64_t now = esp_timer_get_time();
+
+    // Provisional node-ids are derived from the MAC and may collide; the later
+    //  board is left for another parent, or until it holds a lease.
+    const LinkEntry* link = find_entry(id);
+    if ((slot != NULL && !cmp_mac(slot->mac, mac)) ||
+        (link != NULL && !cmp_mac(link->mac, mac))) {
+        ESP_LOGW(TAG, "Node-id 0x%02X already in use by another MAC, not proposing.", id);
+        return -2;
+    }
+
+    for (int i = 0; slot == NULL && i < PENDING_SLOTS; ++i) {
+        if (node.pending[i].id == 0 || node.pending[i].expires <= now) {
+            slot = &node.pending[i];
+        }
+    }
+    if (slot == NULL) {
+        return -1;
+    }
+
+    slot->id = id;
+    memcpy(slot->mac, mac, 6);
+    slot->expires = now + TIMEOUT_PROPOSE_LINK;
+    return 0;
+}
+
+/*
+* Method looks up an outstanding LINK proposal to node-id.
+* Returns NULL if there is none, or it has expired.
+*/
+PendingLink* pending_find(NodeId id) {
+    if (id == 0)
+        return NULL;
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < PENDING_SLOTS; ++i) {
+        if (node.pending[i].id == id && node.pending[i].expires > now) {
+            return &node.pending[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+* Method returns the number of outstanding LINK proposals.
+*/
+int pending_count() {
+    int64_t now = esp_timer_get_time();
+    int count = 0;
+    for (int i = 0; i < PENDING_SLOTS; ++i) {
+        if (node.pending[i].id != 0 && node.pending[i].expires > now) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+* Method hands the parent to svc_store to be recorded in NVS, keeping flash
+*  writes (which stall for milliseconds) off the inbound worker.  Only the
+*  latest parent is kept if several are handed over before the task runs.
+*/
+void parent_save(const Proposal* p) {
+    while (xSemaphoreTake(node.store_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    node.unsaved = *p;
+    node.store_pending |= STORE_PARENT;
+    xSemaphoreGive(node.store_lock);
+
+    xTaskNotifyGive(node.svc_store);
+}
+
+/*
+* Method writes out whatever parent_save(..), lease_save() and id_save(..) left
+*  pending.  Runs on svc_store.
+*/
+void store_flush() {
+    while (xSemaphoreTake(node.store_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    Proposal p = node.unsaved;
+    NodeId id = node.unsaved_id;
+    int pending = node.store_pending;
+    node.store_pending = 0;
+    xSemaphoreGive(node.store_lock);
+
+    if (pending & STORE_PARENT) {
+        parent_write(&p);
+    }
+    if (pending & STORE_LEASES) {
+        lease_write();
+    }
+    if (pending & STORE_ID) {
+        id_write(id);
+    }
+}
+
+/*
+* Method records the parent in NVS, unless it is already the one recorded.
+* Returns 0 on success, non-zero on failure.
+*/
+int parent_write(const Proposal* p) {
+    Proposal last;
+    if (parent_load(&last) == 0 && last.id == p->id && cmp_mac(last.mac, p->mac)) {
+        return 0;
+    }
+
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS, last parent not saved.");
+        return -1;
+    }
+    esp_err_t err = nvs_set_blob(h, NVS_KEY_PARENT, p, sizeof(Proposal));
+    if (err == ESP_OK) {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save last parent.");
+        return -2;
+    }
+    return 0;
+}
+
+/*
+* Method reads the last parent from NVS.
+* Returns 0 on success, non-zero if there is none (or from other firmware).
+*/
+int parent_load(Proposal* p) {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return -1;
+    }
+    size_t size = sizeof(Proposal);
+    esp_err_t err = nvs_get_blob(h, NVS_KEY_PARENT, p, &size);
+    nvs_close(h);
+
+    if (err != ESP_OK || size != sizeof(Proposal) || p->id == 0) {
+        return -2;
+    }
+    return 0;
+}
+
+/*
+* Method picks the node-id to start with when it is leased from the root: the
+*  last lease, kept in NVS, else a provisional one derived from the MAC.
+*/
+NodeId lease_start() {
+    NodeId id;
+    if (id_load(&id) == 0) {
+        return id;
+    }
+
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    return LEASE_PROVISIONAL + mac_pack(mac) % (link_broadcast.id - LEASE_PROVISIONAL);
+}
+
+/*
+* Method asks the root, through the parent, for a node-id lease.  A node which
+*  already holds one sends it along, so the root confirms rather than moves it.
+*/
+void lease_request() {
+    NetFrame out = {};
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = node.id;
+    out.head.destination = node.link_table.entry[LINK_UP].id;
+    out.head.control = CONTROL_LEASE;
+    out.head.reserved[RES_ORIGIN] = node.id;
+    esp_read_mac(out.contents + LEASE_MAC, ESP_MAC_WIFI_STA);
+    out.contents[LEASE_ID] = (node.flags & STATE_UNLEASED) ? 0 : node.id;
+    out.head.reserved[RES_LENGTH] = LEASE_SIZE;
+
+    net_send_raw(&out);
+}
+
+/*
+* Method passes a lease grant one hop down, towards RES_TARGET along the route
+*  learned from its request.  The requester's parent renames its link first, so
+*  the grant already reaches the requester under the leased node-id.
+*/
+void lease_forward(NetFrame* frame) {
+    NodeId target = frame->head.reserved[RES_TARGET];
+    NodeId leased = frame->contents[LEASE_ID];
+
+    LinkEntry* child = find_entry(target);
+    if (child != NULL && is_downstream(target) && child->key == mac_pack(frame->contents + LEASE_MAC)) {
+        if (leased != 0 && leased != target) {
+            link_rename(&node.link_table, child - node.link_table.entry, leased);
+            target = leased;
+        }
+        net_send_frame(frame, target);
+        return;
+    }
+
+    NodeId via = route_lookup(target);
+    if (via == 0) {
+        ESP_LOGW(TAG, "No route to 0x%02X, lease grant dropped.", target);
+        return;
+    }
+    net_send_frame(frame, via);
+}
+
+/*
+* Method takes on the node-id leased by the root.  Should a node which already
+*  had children be moved, they lose sight of their parent and rejoin it.
+*/
+void lease_adopt(NodeId id) {
+    if (id == 0) {
+        ESP_LOGE(TAG, "Root has no node-id left to lease.");
+        return;
+    }
+
+    if (id != node.id) {
+        ESP_LOGI(TAG, "Leased node-id 0x%02X, was 0x%02X", id, node.id);
+        node.id = id;
+    }
+    node.flags &= ~(STATE_UNLEASED);
+    id_save(id);
+}
+
+/*
+* Method leases a node-id to the MAC, at the root: the one already leased to
+*  it, else the one it holds if that is free (the root may have lost its
+*  table), else the lowest free one.  Leases never expire, so a node-id is only
+*  ever reused by the board it was first leased to.
+* Returns the node-id, 0 if every one is taken.
+*/
+NodeId lease_grant(const uint8_t* mac, NodeId held) {
+    uint64_t key = mac_pack(mac);
+    for (int i = LEASE_FIRST; i <= LEASE_LAST; ++i) {
+        if (mac_pack(lease_macs[i]) == key) {
+            return i;
+        }
+    }
+
+    NodeId id = 0;
+    if (held >= LEASE_FIRST && held <= LEASE_LAST && mac_pack(lease_macs[held]) == 0) {
+        id = held;
+    }
+    for (int i = LEASE_FIRST; id == 0 && i <= LEASE_LAST; ++i) {
+        if (mac_pack(lease_macs[i]) == 0) {
+            id = i;
+        }
+    }
+    if (id == 0) {
+        ESP_LOGE(TAG, "Node-ids exhausted, no lease for %02X:%02X:%02X:%02X:%02X:%02X",
+            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        return 0;
+    }
+
+    ESP_LOGI(TAG, "Leased node-id 0x%02X to %02X:%02X:%02X:%02X:%02X:%02X", id,
+        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    memcpy(lease_macs[id], mac, 6);
+    node.leases++;
+    lease_save();
+    return id;
+}
+
+/*
+* Method reads the root's leases from NVS.
+* Returns 0 on success, non-zero if there are none (or from other firmware).
+*/
+int lease_load() {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return -1;
+    }
+    size_t size = sizeof(lease_macs);
+    esp_err_t err = nvs_get_blob(h, NVS_KEY_LEASES, lease_macs, &size);
+    nvs_close(h);
+
+    if (err != ESP_OK || size != sizeof(lease_macs)) {
+        memset(lease_macs, 0, sizeof(lease_macs));
+        return -2;
+    }
+
+    node.leases = 0;
+    for (int i = LEASE_FIRST; i <= LEASE_LAST; ++i) {
+        if (i != node.id && mac_pack(lease_macs[i]) != 0) {
+            node.leases++;
+        }
+    }
+    return 0;
+}
+
+/*
+* Method hands the root's leases to svc_store to be recorded in NVS, like
+*  parent_save(..).  The table itself is not copied: a grant made while it is
+*  being written leaves it pending again, so the latest one is always recorded.
+*/
+void lease_save() {
+    while (xSemaphoreTake(node.store_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    node.store_pending |= STORE_LEASES;
+    xSemaphoreGive(node.store_lock);
+
+    xTaskNotifyGive(node.svc_store);
+}
+
+/*
+* Method records the root's leases in NVS.
+* Returns 0 on success, non-zero on failure.
+*/
+int lease_write() {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS, leases not saved.");
+        return -1;
+    }
+    esp_err_t err = nvs_set_blob(h, NVS_KEY_LEASES, lease_macs, sizeof(lease_macs));
+    if (err == ESP_OK) {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save leases.");
+        return -2;
+    }
+    return 0;
+}
+
+/*
+* Method hands the leased node-id to svc_store to be recorded in NVS, like
+*  parent_save(..).
+*/
+void id_save(NodeId id) {
+    while (xSemaphoreTake(node.store_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    node.unsaved_id = id;
+    node.store_pending |= STORE_ID;
+    xSemaphoreGive(node.store_lock);
+
+    xTaskNotifyGive(node.svc_store);
+}
+
+/*
+* Method records the leased node-id in NVS, unless it is already the one recorded.
+* Returns 0 on success, non-zero on failure.
+*/
+int id_write(NodeId id) {
+    NodeId last;
+    if (id_load(&last) == 0 && last == id) {
+        return 0;
+    }
+
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS, node-id not saved.");
+        return -1;
+    }
+    esp_err_t err = nvs_set_u8(h, NVS_KEY_ID, id);
+    if (err == ESP_OK) {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save node-id.");
+        return -2;
+    }
+    return 0;
+}
+
+/*
+* Method reads the leased node-id from NVS.
+* Returns 0 on success, non-zero if there is none.
+*/
+int id_load(NodeId* id) {
+    nvs_handle_t h;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return -1;
+    }
+    esp_err_t err = nvs_get_u8(h, NVS_KEY_ID, id);
+    nvs_close(h);
+
+    if (err != ESP_OK || *id < LEASE_FIRST || *id > LEASE_LAST) {
+        return -2;
+    }
+    return 0;
+}
+
+/*
+* Method returns to the old parent after the new one failed to answer.  The old
+*  parent never dropped the link; the new one lets it decay.
+*/
+void migrate_revert() {
+    ESP_LOGW(TAG, "Parent 0x%02X did not answer, staying with 0x%02X",
+        node.parent.id, node.former.id);
+
+    node.flags &= ~(STATE_MIGRATING | STATE_UPLINK_STATUS);
+    wheel_stop(&node.link_table.entry[LINK_UP].timer);
+    link_remove(&node.link_table, LINK_UP);
+    form_uplink(&node.link_table, node.former.mac, node.former.id);
+    node.parent = node.former;
+    node.former.id = 0;
+
+    subscribe_update(1);
+}
+
+/*
+* Method checks link table.  If there are available down-stream entries, it
+*  returns the index associated with that entry.  Returns negative if there
+*  are no down-stream links available.
+*/
+int has_available_downlinks(const LinkTable* table) {
+    assert(table != NULL);
+
+    for (int w = 0; w < LINK_WORDS; ++w) {
+        uint32_t free = ~table->usage[w];
+        if (w == LINK_UP / 32) {
+            free &= ~(1ul << (LINK_UP % 32));
+        }
+        if (free != 0) {
+            int x = w * 32 + __builtin_ctz(free);
+            return (x < LINK_TABLE_SIZE ? x : -1);
+        }
+    }
+    return -1;
+}
+
+/*
+* Predicate method, returns non-zero if entry x of the link table is in use.
+*/
+int link_used(const LinkTable* table, int x) {
+    return (table->usage[x / 32] >> (x % 32)) & 1;
+}
+
+/*
+* Method marks entry x in use and adds it to the id and MAC indices.  The
+*  entry's id and MAC must already be filled in.
+*/
+void link_insert(LinkTable* table, int x) {
+    LinkEntry* link = &table->entry[x];
+
+    link->key = mac_pack(link->mac);
+    table->usage[x / 32] |= (1ul << (x % 32));
+    table->by_id[link->id] = x;
+
+    uint32_t h = (uint32_t)((link->key * 0x9E3779B97F4A7C15ull) >> 32) & (LINK_MAC_HASH - 1);
+    while (table->by_mac[h] != LINK_NONE) {
+        h = (h + 1) & (LINK_MAC_HASH - 1);
+    }
+    table->by_mac[h] = x;
+}
+
+/*
+* Method frees entry x.  Links change rarely, so the MAC index is simply
+*  rebuilt rather than deleted from.
+*/
+void link_remove(LinkTable* table, int x) {
+    LinkEntry* link = &table->entry[x];
+
+    table->usage[x / 32] &= ~(1ul << (x % 32));
+    if (table->by_id[link->id] == x) {
+        table->by_id[link->id] = LINK_NONE;
+    }
+    link->id = 0;
+    link->key = 0;
+    memset(link->mac, 0, 6);
+
+    memset(table->by_mac, LINK_NONE, LINK_MAC_HASH);
+    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
+        if (link_used(table, i) && table->entry[i].id != 0) {
+            link_insert(table, i);
+        }
+    }
+}
+
+/*
+* Method moves entry x to another node-id, keeping its timer, pacing and
+*  interest.  A stale entry already holding that node-id is dropped.
+*/
+void link_rename(LinkTable* table, int x, NodeId id) {
+    LinkEntry* link = &table->entry[x];
+
+    int y = table->by_id[id];
+    if (y != LINK_NONE && y != x && y != LINK_UP) {
+        wheel_stop(&table->entry[y].timer);
+        link_remove(table, y);
+    }
+
+    if (table->by_id[link->id] == x) {
+        table->by_id[link->id] = LINK_NONE;
+    }
+    link->id = id;
+    table->by_id[id] = x;
+}
+
+/*
+* Method looks up a packed MAC in the link table.  Returns the entry index, or
+*  negative if no link has that MAC.
+*/
+int link_by_mac(const LinkTable* table, uint64_t key) {
+    uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (LINK_MAC_HASH - 1);
+    while (table->by_mac[h] != LINK_NONE) {
+        if (table->entry[table->by_mac[h]].key == key) {
+            return table->by_mac[h];
+        }
+        h = (h + 1) & (LINK_MAC_HASH - 1);
+    }
+    return -1;
+}
+
+/*
+* Method packs a MAC address into the low 48 bits of an integer.
+*/
+uint64_t mac_pack(const uint8_t* mac) {
+    uint64_t key = 0;
+    for (int i = 0; i < 6; ++i) {
+        key = (key << 8) | mac[i];
+    }
+    return key;
+}
+
+/*
+* Method returns 0 on success, non-zero otherwise.
+*/
+int form_uplink(LinkTable* table, const uint8_t* mac, NodeId id) {
+    assert(table != NULL);
+    assert(mac != NULL);
+    assert(id > 0);
+
+    if (link_used(table, LINK_UP)) {
+        ESP_LOGE(TAG, "Up-stream virtual link already established.");
+        return -1;
+    }
+
+    table->entry[LINK_UP].id = id;
+    table->entry[LINK_UP].version = NETWORK_VERSION;
+    // Counts as idle, the first check is always made.
+    table->entry[LINK_UP].last_rx = esp_timer_get_time() - PERIOD_UP_STATUS;
+    table->entry[LINK_UP].last_tx = table->entry[LINK_UP].last_rx;
+    table->entry[LINK_UP].credited = 0;
+    table->entry[LINK_UP].credit_seq = 0;
+    table->entry[LINK_UP].credit_limit = 0;
+    memcpy(table->entry[LINK_UP].mac, mac, 6);
+    link_insert(table, LINK_UP);
+    pace_init(&table->entry[LINK_UP].pace, &node.pace_default);
+
+    uint64_t wnd = PERIOD_UP_STATUS + (esp_random() % WINDOW_UP_STATUS);
+    wheel_start(&table->entry[LINK_UP].timer, wnd);
+
+    // A new parent is kept for at least one period before looking for better.
+    wnd = PERIOD_REOPT + (esp_random() % WINDOW_REOPT);
+    wheel_start(&node.reopt_timer, wnd);
+
+    return 0;
+}
+
+/*
+* Method returns 0 on success, non-zero otherwise.
+*/
+int form_downlink(LinkTable* table, const uint8_t* mac, NodeId id) {
+    assert(table != NULL);
+    assert(mac != NULL);
+    assert(id > 0);
+
+    // A child which restarted and rejoins before its old link decayed replaces
+    //  that link, rather than being linked twice.  Another board on the same
+    //  node-id does not.
+    int x = table->by_id[id];
+    if (x != LINK_NONE && x != LINK_UP) {
+        if (!cmp_mac(table->entry[x].mac, mac)) {
+            ESP_LOGE(TAG, "Cannot form down-stream link, node-id 0x%02X in use.", id);
+            return -2;
+        }
+        wheel_stop(&table->entry[x].timer);
+        link_remove(table, x);
+    }
+
+    x = has_available_downlinks(table);
+    if (x < 0) {
+        ESP_LOGE(TAG, "Cannot form down-stream link, link table full.");
+        return -1;
+    }
+
+    table->entry[x].id = id;
+    table->entry[x].version = NETWORK_VERSION;
+    table->entry[x].advertised = 0;
+    table->entry[x].interest = 0;
+    table->entry[x].credit_seq = 0;
+    table->entry[x].credit_limit = 0;
+    table->entry[x].starved = 0;
+    table->entry[x].last_rx = esp_timer_get_time();
+    table->entry[x].last_tx = table->entry[x].last_rx;
+    memcpy(table->entry[x].mac, mac, 6);
+    link_insert(table, x);
+    pace_init(&table->entry[x].pace, &node.pace_default);
+
+    wheel_start(&table->entry[x].timer, TIMEOUT_LINK_DECAY);
+
+    return 0;
+}
+
+/*
+* Method checks whether the (MAC, node-id) pair matches an existing link in
+*  the link table.
+*/
+int valid_link(const uint8_t* mac, NodeId id) {
+    int x = link_by_mac(&node.link_table, mac_pack(mac));
+    return (x >= 0 && node.link_table.entry[x].id == id ? 1 : 0);
+}
+
+/*
+* Predicate method, returns non-zero if the node-id is a node to which we are
+*  virtually linked, upstream or down.
+*/
+int is_linked(NodeId id) {
+    assert(id != 0);
+
+    return (node.link_table.by_id[id] != LINK_NONE ? 1 : 0);
+}
+
+/*
+* Predicate method, returns non-zero if node-id is the up-stream link for
+*  this node.
+*/
+int is_upstream(NodeId id) {
+    assert(id != 0);
+
+    return (node.link_table.by_id[id] == LINK_UP ? 1 : 0);
+}
+
+/*
+* Predicate method, returns non-zero if node-id is a down-stream link for
+*  this node.
+*/
+int is_downstream(NodeId id) {
+    assert(id != 0);
+
+    uint8_t x = node.link_table.by_id[id];
+    return (x != LINK_NONE && x != LINK_UP ? 1 : 0);
+}
+
+/*
+* Predicate method, returns non-zero if the two mac addresses provided
+*  are identical.
+*/
+int cmp_mac(const uint8_t* mac_a, const uint8_t* mac_b) {
+    assert(mac_a != NULL);
+    assert(mac_b != NULL);
+
+    if (mac_a == mac_b) {
+        ESP_LOGW(TAG, "Warning: cmp_mac(..) called on identical pointers.");
+    }
+
+    return (mac_pack(mac_a) == mac_pack(mac_b) ? 1 : 0);
+}
+
+void init_sys() {
+    esp_now_peer_info_t peerInfo = {};
+
+    ESP_ERROR_CHECK(nvs_flash_init());        // initialize NVS
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+
+    if (esp_now_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Error initializing ESP-NOW");
+        return;
+    }
+    esp_now_register_recv_cb(espnow_recv);
+    esp_now_register_send_cb(espnow_sent);
+
+#if NET_RSSI_PROMISC
+    // Promiscuous mode only to learn the signal strength of received frames,
+    //  which the ESP-NOW callback does not report.
+    wifi_promiscuous_filter_t filter = { .filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT };
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(promisc_recv);
+    if (esp_wifi_set_promiscuous(true) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to enable promiscuous mode, parent choice ignores RSSI.");
+    }
+#endif
+
+    //  register the broadcast address
+    memcpy(peerInfo.peer_addr, link_broadcast.mac, 6);
+    peerInfo.channel = 0;
+    peerInfo.ifidx = ESP_IF_WIFI_STA;
+    peerInfo.encrypt = false;
+    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add peer");
+        return;
+    }
+
+    // Initialize the outbound packet queues, one per traffic class.  They carry
+    //  frame pointers only, the frames themselves live in the frame pool.
+    outbound[CLASS_CONTROL].depth = OUTBOUND_CONTROL_SIZE;
+    outbound[CLASS_DATA].depth = OUTBOUND_DATA_SIZE;
+    for (int i = 0; i < TRAFFIC_CLASSES; ++i) {
+        outbound[i].queue = xQueueCreate(outbound[i].depth, sizeof(OutboundItem));
+        if (!outbound[i].queue) {
+            ESP_LOGE(TAG, "Failed to create outbound packet queue.");
+            return;
+        }
+    }
+    outbound_ready = xSemaphoreCreateCounting(OUTBOUND_CONTROL_SIZE + OUTBOUND_DATA_SIZE, 0);
+    if (!outbound_ready) {
+        ESP_LOGE(TAG, "Failed to create outbound semaphore.");
+        return;
+    }
+
+    frame_free = xQueueCreate(FRAME_POOL_SIZE - FRAME_RESERVE_CONTROL, sizeof(NetFrame*));
+    frame_reserve = xQueueCreate(FRAME_RESERVE_CONTROL, sizeof(NetFrame*));
+    if (!frame_free || !frame_reserve) {
+        ESP_LOGE(TAG, "Failed to create outbound frame pool.");
+        return;
+    }
+    for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+        NetFrame* frame = &frame_pool[i].frame;
+        xQueueSend(i < FRAME_POOL_SIZE - FRAME_RESERVE_CONTROL ? frame_free : frame_reserve, &frame, 0);
+    }
+
+    rx_free = xQueueCreate(RX_BUFFER_COUNT, sizeof(RxBuffer*));
+    if (!rx_free) {
+        ESP_LOGE(TAG, "Failed to create receive buffer pool.");
+        return;
+    }
+    for (int i = 0; i < RX_BUFFER_COUNT; ++i) {
+        RxBuffer* buffer = &rx_buffers[i];
+        xQueueSend(rx_free, &buffer, 0);
+    }
+
+    // Zero-initialize the node state.
+    memset(&node, 0, sizeof(NodeState));
+
+    // The inbound worker drives the timing wheel from the moment it starts.
+    wheel_setup();
+
+    // Create the worker task which actually transmits outbound packets.
+    xTaskCreatePinnedToCore(
+        worker_send,
+        "svc_outbound",
+        2048,
+        NULL,
+        6,
+        &node.svc_outbound,
+        1);
+
+    // Create the worker task which dispatches received packets, keeping that
+    //  work out of the Wi-Fi driver callback.
+    xTaskCreatePinnedToCore(
+        worker_recv,
+        "svc_inbound",
+        4096,
+        NULL,
+        7,
+        &node.svc_inbound,
+        1);
+
+    // Create the task on which application handlers are called.
+    xTaskCreatePinnedToCore(
+        worker_apps,
+        "svc_apps",
+        4096,
+        NULL,
+        4,
+        &node.svc_apps,
+        1);
+
+    // Create the task which writes to NVS, behind everything else.
+    xTaskCreatePinnedToCore(
+        worker_store,
+        "svc_store",
+        2048,
+        NULL,
+        2,
+        &node.svc_store,
+        1);
+
+    ESP_LOGI(TAG, "Initialized network layer.");
+}
+
+void init_node(NodeState* node, NodeId id) {
+    // NOTE: Method assumes node has ALREADY been zero-initialized.
+
+    esp_timer_create_args_t timer_init = {};
+
+    init_table(&node->link_table);
+    init_hooks(&node->app_table);
+
+    // Pick a random initial identifier.
+    node->id = id;
+    node->loc_ident = esp_random() % 256;
+    
+
+    // Set up the timers associated with the network layer.  All but pacing run
+    //  from the timing wheel, see wheel_run(..).
+    wheel_timer_init(&node->loc_timer, timer_cb_locating, NULL);
+    wheel_timer_init(&node->status_timer, timer_cb_up_status, NULL);
+    wheel_timer_init(&node->join_timer, timer_cb_join, NULL);
+    wheel_timer_init(&node->reopt_timer, timer_cb_reopt, NULL);
+    wheel_timer_init(&node->listen_timer, timer_cb_listen, NULL);
+    wheel_timer_init(&node->bundle_timer, timer_cb_bundle, NULL);
+    wheel_timer_init(&node->credit_timer, timer_cb_credit, NULL);
+
+    wheel_timer_init(&node->beacon_timer, timer_cb_beacon, NULL);
+    wheel_start(&node->beacon_timer, PERIOD_BEACON + (esp_random() % WINDOW_BEACON));
+
+    node->held_queue = xQueueCreate(HELD_BUFFER_SIZE, sizeof(NetFrame*));
+    if (!node->held_queue) {
+        ESP_LOGE(TAG, "Failed to create held frame queue.");
+        return;
+    }
+
+    node->pace_default.rate = PACE_RATE;
+    node->pace_default.burst = PACE_BURST;
+
+    timer_init.callback = timer_cb_pace;
+    timer_init.arg = NULL;
+    timer_init.dispatch_method = ESP_TIMER_TASK;
+    timer_init.name = "Pacing";
+    if (esp_timer_create(&timer_init, &node->pace_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create timer.");
+        return;
+    }
+
+    timer_init.callback = timer_cb_defer;
+    timer_init.arg = NULL;
+    timer_init.dispatch_method = ESP_TIMER_TASK;
+    timer_init.name = "Deferral";
+    if (esp_timer_create(&timer_init, &node->defer_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create timer.");
+        return;
+    }
+
+    node->up_lock = xSemaphoreCreateBinary();
+    if (node->up_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create up-stream semaphore.");
+        return;
+    }
+    xSemaphoreGive(node->up_lock);
+
+    node->credit_ready = xSemaphoreCreateBinary();
+    if (node->credit_ready == NULL) {
+        ESP_LOGE(TAG, "Failed to create credit semaphore.");
+        return;
+    }
+
+    node->store_lock = xSemaphoreCreateBinary();
+    if (node->store_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create store semaphore.");
+        return;
+    }
+    xSemaphoreGive(node->store_lock);
+}
+
+void init_table(LinkTable* table) {
+    // NOTE: Method assumes table has ALREADY been zero-initialized.
+
+    memset(table->by_id, LINK_NONE, sizeof(table->by_id));
+    memset(table->by_mac, LINK_NONE, sizeof(table->by_mac));
+
+    // NOTE: We stash the INDEX of the relevant entry in the timer cb argument.
+    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
+        wheel_timer_init(&table->entry[i].timer,
+            (i == LINK_UP ? timer_cb_upstream : timer_cb_downstream), (void*)i);
+    }
+}
+
+void init_hooks(AppTable* table) {
+    // NOTE: Method assumes table has ALREADY been zero-initialized.
+
+    table->current = &table->snap[0];
+
+    table->lock = xSemaphoreCreateBinary();
+    if (table->lock == NULL) {
+        ESP_LOGE(TAG, "Failed to initialize app table semaphore.");
+        return;
+    }
+    xSemaphoreGive(table->lock);
+}
+
+/*
+* Method looks up the MAC address associated with a node-id in the link table.
+*  Note that this method will also check the broadcast id and any pending link
+*  node-id.
+* Returns NULL on failure.
+*/
+const uint8_t* find_mac(NodeId id) {
+    if (id == link_broadcast.id) {
+        return link_broadcast.mac;
+    }
+    else if (pending_find(id) != NULL) {
+        return pending_find(id)->mac;
+    }
+    else if (node.direct.id != 0 && id == node.direct.id && (node.flags & STATE_DIRECT)) {
+        return node.direct.mac;
+    }
+
+    LinkEntry* link = find_entry(id);
+    if (link != NULL) {
+        return link->mac;
+    }
+    else if (node.former.id != 0 && id == node.former.id) {
+        // Parent being left, until it has been sent the UNLINK.
+        return node.former.mac;
+    }
+    return NULL;
+}
+
+/*
+* Method looks up the node-id associated with a MAC address in the link table.
+*  Note that method also checks broadcast MAC and pending link MAC.
+* Returns 0 on failure.
+*/
+NodeId find_id(const uint8_t* mac) {
+    if (cmp_mac(mac, link_broadcast.mac)) {
+        return link_broadcast.id;
+    }
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < PENDING_SLOTS; ++i) {
+        if (node.pending[i].id != 0 && node.pending[i].expires > now &&
+            cmp_mac(mac, node.pending[i].mac)) {
+            return node.pending[i].id;
+        }
+    }
+
+    int x = link_by_mac(&node.link_table, mac_pack(mac));
+    return (x >= 0 ? node.link_table.entry[x].id : 0);
+}
+
+/*
+* Method looks up the link table entry associated with a node-id.
+* Returns NULL on failure.
+*/
+LinkEntry* find_entry(NodeId id) {
+    uint8_t x = node.link_table.by_id[id];
+    return (x != LINK_NONE ? node.link_table.entry + x : NULL);
+}
+
+/*
+* Method looks up the inbound packet queue associated with an app-id.  Takes no
+*  lock, but must be called between app_read_lock() and app_read_unlock(), and
+*  the queue may only be used until the latter.
+* Returns NULL on failure.
+*/
+QueueHandle_t find_app(uint16_t app_id) {
+    const AppQueue* app = app_lookup(app_id);
+    return (app != NULL ? app->inbound : NULL);
+}
+
+/*
+* As find_app(..), returning the whole app table entry.
+*/
+const AppQueue* app_lookup(uint16_t app_id) {
+    if (app_id == 0)
+        return NULL;
+
+    const AppSnapshot* snap = __atomic_load_n(&node.app_table.current, __ATOMIC_SEQ_CST);
+    const AppQueue* app = &snap->apps[app_probe(snap, app_id)];
+    return (app->id == app_id ? app : NULL);
+}
+
+/*
+* Method returns the slot holding app-id in the snapshot, or the free slot where
+*  it would be inserted.
+*/
+int app_probe(const AppSnapshot* snap, uint16_t app_id) {
+    // Multiplicative hash, taking the high bits of the 16 bit product.
+    uint32_t x = ((app_id * 40503u) & 0xFFFF) * APP_HASH_SIZE >> 16;
+    while (snap->apps[x].id != 0 && snap->apps[x].id != app_id) {
+        x = (x + 1) & (APP_HASH_SIZE - 1);
+    }
+    return x;
+}
+
+void app_read_lock() {
+    __atomic_add_fetch(&node.app_table.readers, 1, __ATOMIC_SEQ_CST);
+}
+
+void app_read_unlock() {
+    __atomic_sub_fetch(&node.app_table.readers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Method rebuilds the table into the spare snapshot -- adding one entry (NULL for
+*  none) and / or removing one app-id (zero for none) -- and publishes it.  Returns once no reader can
+*  still hold the previous snapshot, which then becomes the spare.
+* NOTE: The caller must hold the app table lock.
+*/
+void app_publish(AppTable* table, const AppQueue* add, uint16_t remove_id) {
+    AppSnapshot* old = table->current;
+    AppSnapshot* next = (old == &table->snap[0] ? &table->snap[1] : &table->snap[0]);
+
+    memset(next, 0, sizeof(AppSnapshot));
+    for (int i = 0; i < APP_HASH_SIZE; ++i) {
+        if (old->apps[i].id != 0 && old->apps[i].id != remove_id) {
+            next->apps[app_probe(next, old->apps[i].id)] = old->apps[i];
+            next->count++;
+        }
+    }
+    if (add != NULL) {
+        next->apps[app_probe(next, add->id)] = *add;
+        next->count++;
+    }
+
+    __atomic_store_n(&table->current, next, __ATOMIC_SEQ_CST);
+
+    // Grace period.  Readers hold the table for a lookup and a queue send, or
+    //  for one round of handler calls.
+    while (__atomic_load_n(&table->readers, __ATOMIC_SEQ_CST) != 0) {
+        vTaskDelay(1);
+    }
+}
+
+
+/*
+* Method takes a zeroed frame from the outbound frame pool, holding one
+*  reference for the caller.  Frames of CLASS_CONTROL may also draw on the
+*  control reserve.  Returns NULL if the pool is exhausted.
+*/
+NetFrame* frame_alloc(int cls) {
+    NetFrame* frame = NULL;
+    if (xQueueReceive(frame_free, &frame, 0) != pdTRUE &&
+        (cls != CLASS_CONTROL || xQueueReceive(frame_reserve, &frame, 0) != pdTRUE)) {
+        ESP_LOGE(TAG, "Failed to allocate frame -- frame pool exhausted.");
+        return NULL;
+    }
+    memset(frame, 0, sizeof(NetFrame));
+    ((PoolFrame*)frame)->refs = 1;
+    return frame;
+}
+
+void frame_retain(NetFrame* frame) {
+    __atomic_add_fetch(&((PoolFrame*)frame)->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Method drops one reference, returning the frame to the pool on the last.
+*/
+void frame_release(NetFrame* frame) {
+    if (__atomic_sub_fetch(&((PoolFrame*)frame)->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        int reserved = ((PoolFrame*)frame >= &frame_pool[FRAME_POOL_SIZE - FRAME_RESERVE_CONTROL]);
+        xQueueSend(reserved ? frame_reserve : frame_free, &frame, 0);
+    }
+}
+
+/*
+* Method takes a receive buffer from the pool.  Returns NULL if the pool is
+*  exhausted.
+*/
+RxBuffer* rx_alloc() {
+    RxBuffer* buffer = NULL;
+    if (xQueueReceive(rx_free, &buffer, 0) != pdTRUE) {
+        return NULL;
+    }
+    buffer->refs = 1;
+    return buffer;
+}
+
+/*
+* Method takes another reference to a receive buffer, for a message lent out.
+*/
+void rx_retain(RxBuffer* buffer) {
+    __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Method drops one reference, returning the buffer to the pool on the last.
+*/
+void rx_release(RxBuffer* buffer) {
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        xQueueSend(rx_free, &buffer, 0);
+    }
+}
+
+/*
+* Method returns the traffic class of a frame: application payloads are data,
+*  everything else is control.
+*/
+int frame_class(const NetFrame* frame) {
+    uint8_t control = frame->head.control;
+    if (control == CONTROL_FANOUT) {
+        control = frame->contents[0];
+    }
+    int data = (control == CONTROL_DEFAULT ||
+        control == CONTROL_BUNDLE ||
+        control == CONTROL_UNICAST);
+    return (data ? CLASS_DATA : CLASS_CONTROL);
+}
+
+/*
+* Method copies a caller-owned frame into the pool and enqueues it for its
+*  header destination.
+*/
+void net_send_raw(NetFrame* frame) {
+    assert(frame != NULL);
+
+    NetFrame* out = frame_alloc(frame_class(frame));
+    if (out == NULL) {
+        return;
+    }
+    memcpy(out, frame, sizeof(NetFrame));
+    net_send_frame(out, frame->head.destination);
+    frame_release(out);
+}
+
+/*
+* Method enqueues a pooled frame for one destination, taking its own reference.
+*  The destination and checksum are patched in by the worker at transmit, so the
+*  same frame may be enqueued for several destinations.  Control frames go to
+*  their own queue, so application bursts cannot crowd out liveness traffic.
+* Returns 0 on success, non-zero if the class queue is full.
+*/
+int net_send_frame(NetFrame* frame, NodeId destination) {
+    assert(frame != NULL);
+
+    // Simple validation -- any outbound packets must have as a destination
+    //  a node-id associated with one of our virtual links, or the broadcast
+    //  address.
+    assert(is_linked(destination) || 
+        destination == link_broadcast.id ||
+        pending_find(destination) != NULL ||
+        (node.direct.id != 0 && destination == node.direct.id) ||
+        (node.former.id != 0 && destination == node.former.id));
+
+    OutboundClass* cls = &outbound[frame_class(frame)];
+    OutboundItem item = { frame, destination };
+    frame_retain(frame);
+    if (xQueueSend(cls->queue, &item, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Failed to send packet -- outbound queue full.");
+        __atomic_add_fetch(&cls->dropped, 1, __ATOMIC_RELAXED);
+        frame_release(frame);
+        return -1;
+    }
+    xSemaphoreGive(outbound_ready);
+
+    uint32_t waiting = uxQueueMessagesWaiting(cls->queue);
+    if (waiting > cls->high_water) {
+        cls->high_water = waiting;
+    }
+    return 0;
+}
+
+/*
+* Method enqueues one pooled frame for every down-stream link.
+*/
+void net_send_downlinks(NetFrame* frame) {
+    net_send_subscribed(frame, 0, 0);
+}
+
+/*
+* Method sends a pooled frame to every down-stream link whose subtree may run
+*  app-id, or to all of them if app-id is zero.  Children which have never
+*  advertised their interest (older nodes) always get a copy.
+* With FANOUT_MIN or more children, all speaking the compact format, a data
+*  frame is a single broadcast frame listing them, unless NET_SEND_RELIABLE is
+*  set.  Broadcasts are neither acknowledged nor retried, so control frames
+*  (BLACKOUT, FREEZE, MAP, MOVED, ..) always go to each child on its own.
+*/
+void net_send_subscribed(NetFrame* frame, uint16_t app_id, int flags) {
+    uint64_t bits = (app_id != 0 ? app_bloom(app_id) : 0);
+    NodeId ids[LINK_TABLE_SIZE];
+    int count = 0;
+    int compact = 1;
+
+    for (int w = 0; w < LINK_WORDS; ++w) {
+        uint32_t used = node.link_table.usage[w];
+        if (w == LINK_UP / 32) {
+            used &= ~(1ul << (LINK_UP % 32));
+        }
+        while (used != 0) {
+            const LinkEntry* link = &node.link_table.entry[w * 32 + __builtin_ctz(used)];
+            used &= used - 1;
+
+            if (link->advertised && (link->interest & bits) != bits) {
+                node.pruned++;
+                continue;
+            }
+            ids[count++] = link->id;
+            compact &= (link->version == NETWORK_VERSION_COMPACT);
+        }
+    }
+
+    if (count >= FANOUT_MIN && compact && !(flags & NET_SEND_RELIABLE) && frame_class(frame) == CLASS_DATA) {
+        NetFrame* fan = fanout_wrap(frame, ids, count);
+        if (fan != NULL) {
+            if (net_send_frame(fan, link_broadcast.id) == 0) {
+                node.fanned++;
+            }
+            frame_release(fan);
+            return;
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        net_send_frame(frame, ids[i]);
+    }
+}
+
+/*
+* Method builds a CONTROL_FANOUT frame around 'frame' for the listed children.
+*  Contents are the inner control, the child count, the child node-ids and then
+*  the inner contents.  Inner RES_IDENT / RES_UPSTREAM are kept in the header.
+* Returns NULL if the result would not fit a frame, or the pool is empty.
+*/
+NetFrame* fanout_wrap(const NetFrame* frame, const NodeId* ids, int count) {
+    int length = frame->head.reserved[RES_LENGTH];
+    if (2 + count + length > FRAME_CONTENTS)
+        return NULL;
+
+    NetFrame* out = frame_alloc(frame_class(frame));
+    if (out == NULL)
+        return NULL;
+
+    out->head = frame->head;
+    out->head.control = CONTROL_FANOUT;
+    out->head.reserved[RES_LENGTH] = 2 + count + length;
+    out->contents[0] = frame->head.control;
+    out->contents[1] = count;
+    memcpy(out->contents + 2, ids, count);
+    memcpy(out->contents + 2 + count, frame->contents, length);
+    return out;
+}
+
+/*
+* Method turns a received CONTROL_FANOUT frame, in place, into the frame it
+*  carries, addressed to 'id'.
+* Returns non-zero if 'id' is among the listed children, otherwise zero (and
+*  the frame is to be ignored).
+*/
+int fanout_unwrap(NetFrame* frame, NodeId id) {
+    int length = frame->head.reserved[RES_LENGTH];
+    if (length < 2 || 2 + frame->contents[1] > length)
+        return 0;
+
+    int count = frame->contents[1];
+    if (memchr(frame->contents + 2, id, count) == NULL)
+        return 0;
+
+    frame->head.control = frame->contents[0];
+    frame->head.destination = id;
+    frame->head.reserved[RES_LENGTH] = length - 2 - count;
+    memmove(frame->contents, frame->contents + 2 + count, length - 2 - count);
+    return 1;
+}
+
+/*
+* Method returns the Bloom filter bits (two of 64) for an app-id.
+*/
+uint64_t app_bloom(uint16_t app_id) {
+    uint32_t h = app_id * 0x9E3779B1u;
+    return (1ull << (h >> 26)) | (1ull << ((h >> 20) & 63));
+}
+
+/*
+* Method summarizes the app-ids registered here and anywhere below as a 64 bit
+*  Bloom filter.  A child which has never advertised counts as running all.
+*/
+uint64_t interest_summary() {
+    uint64_t summary = 0;
+
+    app_read_lock();
+    const AppSnapshot* snap = __atomic_load_n(&node.app_table.current, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < APP_HASH_SIZE; ++i) {
+        if (snap->apps[i].id != 0) {
+            summary |= app_bloom(snap->apps[i].id);
+        }
+    }
+    app_read_unlock();
+
+    for (int x = 0; x < LINK_TABLE_SIZE; ++x) {
+        if (x == LINK_UP || !link_used(&node.link_table, x))
+            continue;
+
+        const LinkEntry* link = &node.link_table.entry[x];
+        summary |= (link->advertised ? link->interest : ~0ull);
+    }
+    return summary;
+}
+
+/*
+* Method advertises the interest summary up-stream if it has changed since
+*  last sent, or regardless if 'force' is set.
+*/
+void subscribe_update(int force) {
+    if (node.isRoot || !has_uplink(&node.link_table))
+        return;
+
+    uint64_t summary = interest_summary();
+    if (!force && summary == node.interest_sent)
+        return;
+
+    NetFrame* out = frame_alloc(CLASS_CONTROL);
+    if (out == NULL)
+        return;
+
+    out->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out->head.source = node.id;
+    out->head.control = CONTROL_SUBSCRIBE;
+    memcpy(out->contents, &summary, sizeof(uint64_t));
+    out->head.reserved[RES_LENGTH] = sizeof(uint64_t);
+
+    if (net_send_frame(out, node.link_table.entry[LINK_UP].id) == 0) {
+        node.interest_sent = summary;
+    }
+    frame_release(out);
+}
+
+/*
+* Method copies one application message into the open up-stream bundle, opening
+*  a new one if needed.  The bundle is sent when the next message would not fit,
+*  or DEADLINE_BUNDLE after its first message, whichever comes first.
+* Returns 0 on success, non-zero if no frame could be allocated.
+*/
+int bundle_append(const app_header_t* head, const uint8_t* data) {
+    int size = sizeof(app_header_t) + head->len;
+
+    while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+
+    if (node.bundle != NULL && node.bundle->head.reserved[RES_LENGTH] + size > FRAME_CONTENTS) {
+        bundle_flush();
+    }
+
+    if (node.bundle == NULL) {
+        node.bundle = frame_alloc(CLASS_DATA);
+        if (node.bundle == NULL) {
+            xSemaphoreGive(node.up_lock);
+            return -3;
+        }
+        node.bundle->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        node.bundle->head.source = node.id;
+        node.bundle->head.control = CONTROL_BUNDLE;
+        node.bundle_count = 0;
+
+        wheel_start(&node.bundle_timer, DEADLINE_BUNDLE);
+    }
+
+    uint8_t* rec = node.bundle->contents + node.bundle->head.reserved[RES_LENGTH];
+    memcpy(rec, head, sizeof(app_header_t));
+    memcpy(rec + sizeof(app_header_t), data, head->len);
+    node.bundle->head.reserved[RES_LENGTH] += size;
+    node.bundle_count++;
+
+    // Nothing more fits, no point waiting out the deadline.
+    if (node.bundle->head.reserved[RES_LENGTH] + sizeof(app_header_t) > FRAME_CONTENTS) {
+        bundle_flush();
+    }
+
+    xSemaphoreGive(node.up_lock);
+    return 0;
+}
+
+/*
+* Method enqueues the open bundle for the up-stream link.  A bundle holding
+*  a single message goes out as a plain application frame.
+* NOTE: The caller must hold the up-stream lock.
+*/
+void bundle_flush() {
+    if (node.bundle == NULL)
+        return;
+
+    wheel_stop(&node.bundle_timer);
+
+    if (node.bundle_count == 1) {
+        node.bundle->head.control = CONTROL_DEFAULT;
+    }
+    if (has_uplink(&node.link_table) || (node.flags & STATE_ORPHAN)) {
+        uplink_send(node.bundle);
+    }
+    frame_release(node.bundle);
+    node.bundle = NULL;
+    node.bundle_count = 0;
+}
+
+/*
+* TIMER CALLBACK method -- the deadline of the open bundle has elapsed.
+*/
+void timer_cb_bundle(void* param) {
+    while (xSemaphoreTake(node.up_lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    bundle_flush();
+    xSemaphoreGive(node.up_lock);
+}
+
+/*
+* Method sets the pacing of the link to node-id, or the default for new links
+*  (and broadcast / pending traffic) if id is zero.
+* Returns 0 on success, non-zero if no such link exists.
+*/
+int net_set_pacing(NodeId id, uint16_t rate, uint16_t burst) {
+    assert(rate > 0 && burst > 0);
+
+    Pacer* pace = &node.pace_default;
+    if (id != 0) {
+        LinkEntry* link = find_entry(id);
+        if (link == NULL) {
+            return -1;
         }
+        pace = &link->pace;
     }
+    pace->rate = rate;
+    pace->burst = burst;
     return 0;
 }
 
+void pace_init(Pacer* pace, const Pacer* from) {
+    pace->rate = from->rate;
+    pace->burst = from->burst;
+    pace->tat = 0;
+}
+
 /*
-* Predicate method, returns non-zero if the node-id is a node to which we are
-*  virtually linked, upstream or down.
+* Method returns the time (microseconds) until the bucket admits one more frame.
 */
-int is_linked(NodeId id) {
-    return ((is_upstream(id) | is_downstream(id)) != 0 ? 1 : 0);
+int64_t pace_delay(const Pacer* pace, int64_t now) {
+    int64_t interval = US_FACTOR / pace->rate;
+    int64_t wait = pace->tat - (int64_t)(pace->burst - 1) * interval - now;
+    return (wait > 0 ? wait : 0);
 }
 
 /*
-* Predicate method, returns non-zero if node-id is the up-stream link for
-*  this node.
+* Method takes one frame worth of tokens out of the bucket.
 */
-int is_upstream(NodeId id) {
-    assert(id != 0);
-
-    return (id == node.link_table.entry[LINK_UP].id ? 1 : 0);
+void pace_commit(Pacer* pace, int64_t now) {
+    int64_t interval = US_FACTOR / pace->rate;
+    pace->tat = (pace->tat > now ? pace->tat : now) + interval;
 }
 
 /*
-* Predicate method, returns non-zero if node-id is a down-stream link for
-*  this node.
+* Method blocks the calling (outbound worker) task with microsecond resolution,
+*  FreeRTOS ticks are far too coarse for pacing.
 */
-int is_downstream(NodeId id) {
-    assert(id != 0);
-
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (i == LINK_UP)
-            continue;
-
-        if (node.link_table.usage & (1ul << i) && node.link_table.entry[i].id == id) {
-            return 1;
-        }
+void pace_sleep(int64_t us) {
+    if (esp_timer_start_once(node.pace_timer, us) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start pacing timer.");
+        return;
     }
-    return 0;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 }
 
 /*
-* Predicate method, returns non-zero if the two mac addresses provided
-*  are identical.
+* Method returns the bucket frames to a node-id draw on.
 */
-int cmp_mac(const uint8_t* mac_a, const uint8_t* mac_b) {
-    assert(mac_a != NULL);
-    assert(mac_b != NULL);
+Pacer* pace_of(NodeId id) {
+    LinkEntry* link = find_entry(id);
+    return (link != NULL ? &link->pace : &node.pace_default);
+}
 
-    if (mac_a == mac_b) {
-        ESP_LOGW(TAG, "Warning: cmp_mac(..) called on identical pointers.");
+/*
+* Method sets a data frame aside if its bucket does not admit it yet, or if an
+*  earlier frame to the same node-id is still waiting: frames to one link keep
+*  their order.  Re-arms the deferral timer for the earliest frame.
+* Returns 0 if the frame was set aside, non-zero if it is to be sent now, or
+*  there is no room left to set it aside.
+*/
+int outbound_defer(const OutboundItem* item) {
+    int64_t now = esp_timer_get_time();
+    int queued = 0;
+    for (int i = 0; i < deferred_count; ++i) {
+        if (deferred[i].destination == item->destination) {
+            queued = 1;
+            break;
+        }
     }
-
-    for (int i = 0; i < 6; ++i) {
-        if (mac_a[i] != mac_b[i])
-            return 0;
+    if (!queued && pace_delay(pace_of(item->destination), now) == 0) {
+        return 1;
+    }
+    if (deferred_count == OUTBOUND_DATA_SIZE) {
+        return -1;
     }
-    return 1;
-}
-
-uint8_t pak_checksum(const NetFrame* frame) {
-    int offset_check = 3;
 
-    uint8_t  balance = 0;
-    const uint8_t* work = (const uint8_t*)frame;
+    deferred[deferred_count++] = *item;
+    outbound[CLASS_DATA].deferred++;
 
-    for (int i = 0; i < sizeof(NetFrame); ++i) {
-        if (i != offset_check) {
-            balance = balance ^ work[i];
+    int64_t wait = INT64_MAX;
+    for (int i = 0; i < deferred_count; ++i) {
+        int64_t delay = pace_delay(pace_of(deferred[i].destination), now);
+        if (delay < wait) {
+            wait = delay;
         }
     }
-    return balance;
+    esp_timer_stop(node.defer_timer);
+    if (esp_timer_start_once(node.defer_timer, (wait > 0 ? wait : 1)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start deferral timer.");
+    }
+    return 0;
 }
 
-void init_sys() {
-    esp_now_peer_info_t peerInfo = {};
-
-    ESP_ERROR_CHECK(nvs_flash_init());        // initialize NVS
+/*
+* Method sends every set-aside frame which its bucket now admits, oldest first,
+*  and re-arms the deferral timer for the rest.
+*/
+void outbound_retry() {
+    if (deferred_count == 0) {
+        return;
+    }
 
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    int kept = 0;
+    int64_t wait = INT64_MAX;
+    for (int i = 0; i < deferred_count; ++i) {
+        OutboundItem item = deferred[i];
 
-    if (esp_now_init() != ESP_OK) {
-        ESP_LOGE(TAG, "Error initializing ESP-NOW");
-        return;
+        // Nothing overtakes an earlier frame to the same node-id.
+        int blocked = 0;
+        for (int j = 0; j < kept; ++j) {
+            if (deferred[j].destination == item.destination) {
+                blocked = 1;
+                break;
+            }
+        }
+        int64_t delay = pace_delay(pace_of(item.destination), esp_timer_get_time());
+        if (blocked || delay > 0) {
+            deferred[kept++] = item;
+            if (delay < wait) {
+                wait = delay;
+            }
+            continue;
+        }
+        outbound_transmit(&item, 0);
     }
-    esp_now_register_recv_cb(espnow_recv);
+    deferred_count = kept;
 
-    //  register the broadcast address
-    memcpy(peerInfo.peer_addr, link_broadcast.mac, 6);
-    peerInfo.channel = 0;
-    peerInfo.ifidx = ESP_IF_WIFI_STA;
-    peerInfo.encrypt = false;
-    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to add peer");
-        return;
+    if (kept > 0) {
+        esp_timer_stop(node.defer_timer);
+        if (esp_timer_start_once(node.defer_timer, (wait > 0 ? wait : 1)) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start deferral timer.");
+        }
     }
+}
 
-    // Initialize the outbound packet queue.
-    outbound = xQueueCreate(16, sizeof(NetFrame));
-    if (!outbound) {
-        ESP_LOGE(TAG, "Failed to create outbound packet queue.");
-        return;
+/*
+* Method sends one outbound item, after 'wait' microseconds plus a minor random
+*  delay to mitigate collisions on a busy channel, and draws it from its bucket.
+*  Drops the worker's reference to the frame.
+*/
+void outbound_transmit(OutboundItem* item, int64_t wait) {
+    LinkEntry* link = find_entry(item->destination);
+    Pacer* pace = (link != NULL ? &link->pace : &node.pace_default);
+    if (PACE_JITTER > 0) {
+        wait += esp_random() % PACE_JITTER;
+    }
+    if (wait > 0) {
+        pace_sleep(wait);
+    }
+    pace_commit(pace, esp_timer_get_time());
+
+    // Only this task touches a frame once it is enqueued, so the shared buffer
+    //  can be patched in place: destination, checksum, and for the compact
+    //  format the header bytes in front of the contents.
+    NetFrame* packet = item->frame;
+    uint8_t version = (link != NULL ? link->version : NETWORK_VERSION);
+    if (packet->head.control == CONTROL_FANOUT) {
+        // Only ever built for children speaking the compact format.
+        version = NETWORK_VERSION_COMPACT;
+    }
+    uint8_t saved[COMPACT_HEADER_SIZE];
+    memcpy(saved, packet->contents - COMPACT_HEADER_SIZE, COMPACT_HEADER_SIZE);
+
+    const uint8_t* mac = find_mac(item->destination);
+    const uint8_t* wire = NULL;
+    int len = wire_encode(packet, item->destination, version, &wire);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Packet too long for legacy peer 0x%02X, dropped.", item->destination);
+    }
+    else if (mac == NULL) {
+        // Link went away while the packet was queued.  Note that a NULL
+        //  address would have esp_now_send(..) go to every peer.
+        ESP_LOGW(TAG, "Packet for unlinked node 0x%02X, dropped.", item->destination);
+    }
+    else if (peer_install(mac) != 0) {
+        ESP_LOGE(TAG, "Failed to install peer for 0x%02X, dropped.", item->destination);
+    }
+    else if (esp_now_send(mac, wire, len) != ESP_OK) {
+        ESP_LOGE(TAG, "Packet send failure.");
     }
 
-    // Zero-initialize the node state.
-    memset(&node, 0, sizeof(NodeState));
+    memcpy(packet->contents - COMPACT_HEADER_SIZE, saved, COMPACT_HEADER_SIZE);
+    frame_release(packet);
+}
 
-    // Create the worker task which actually transmits outbound packets.
-    xTaskCreatePinnedToCore(
-        worker_send,
-        "svc_outbound",
-        2048,
-        NULL,
-        6,
-        &node.svc_outbound,
-        1);
+/*
+* TIMER CALLBACK method -- wakes the outbound worker after a pacing delay.
+*/
+void timer_cb_pace(void* param) {
+    xTaskNotifyGive(node.svc_outbound);
+}
 
-    ESP_LOGI(TAG, "Initialized network layer.");
+/*
+* TIMER CALLBACK method -- wakes the outbound worker when the first set-aside
+*  frame's bucket admits it.  The extra semaphore count finds no queued item.
+*/
+void timer_cb_defer(void* param) {
+    xSemaphoreGive(outbound_ready);
 }
 
-void init_node(NodeState* node, NodeId id) {
-    // NOTE: Method assumes node has ALREADY been zero-initialized.
+/*
+* Method sets up the (empty) timing wheel, tick 0 is now.
+*/
+void wheel_setup() {
+    memset(&wheel, 0, sizeof(TimerWheel));
+    for (int i = 0; i < WHEEL_SLOTS; ++i) {
+        wheel.slot[0][i].next = wheel.slot[0][i].prev = &wheel.slot[0][i];
+        wheel.slot[1][i].next = wheel.slot[1][i].prev = &wheel.slot[1][i];
+    }
+    wheel.start = esp_timer_get_time();
 
-    esp_timer_create_args_t timer_init = {};
+    wheel.lock = xSemaphoreCreateBinary();
+    if (wheel.lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create timing wheel semaphore.");
+        return;
+    }
+    xSemaphoreGive(wheel.lock);
+}
 
-    init_table(&node->link_table);
-    init_hooks(&node->app_table);
+/*
+* Method prepares a stopped timer which calls callback(arg) when due.
+*/
+void wheel_timer_init(WheelTimer* timer, void (*callback)(void*), void* arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
 
-    // Pick a random initial identifier.
-    node->id = id;
-    node->loc_ident = esp_random() % 256;
-    
+/*
+* Method returns the current wheel tick.
+*/
+uint32_t wheel_tick_now() {
+    return (uint32_t)((esp_timer_get_time() - wheel.start) / WHEEL_TICK);
+}
 
-    // Set up the timers associated with the network layer.
-    timer_init.callback = timer_cb_pending_link;
-    timer_init.arg = NULL;
-    timer_init.dispatch_method = ESP_TIMER_TASK;
-    timer_init.name = "LinkProposal";
-    if (esp_timer_create(&timer_init, &node->pending_timer) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create timer.");
-        return;
+/*
+* Method (re)starts a timer to fire once, no sooner than 'us' microseconds from
+*  now.  May be called from any task, including from a timer callback.
+*/
+void wheel_start(WheelTimer* timer, uint64_t us) {
+    uint64_t ticks = (us + WHEEL_TICK - 1) / WHEEL_TICK;
+    if (ticks == 0) {
+        ticks = 1;
     }
 
-    timer_init.callback = timer_cb_locating;
-    timer_init.arg = NULL;
-    timer_init.dispatch_method = ESP_TIMER_TASK;
-    timer_init.name = "Locate";
-    if (esp_timer_create(&timer_init, &node->loc_timer) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create timer.");
-        return;
+    while (xSemaphoreTake(wheel.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
     }
-
-    timer_init.callback = timer_cb_up_status;
-    timer_init.arg = NULL;
-    timer_init.dispatch_method = ESP_TIMER_TASK;
-    timer_init.name = "UpStatus";
-    if (esp_timer_create(&timer_init, &node->status_timer) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create timer.");
-        return;
+    if (timer->next != NULL) {
+        wheel_unlink(timer);
     }
 
-    timer_init.callback = timer_cb_join;
-    timer_init.arg = NULL;
-    timer_init.dispatch_method = ESP_TIMER_TASK;
-    timer_init.name = "NetJoin";
-    if (esp_timer_create(&timer_init, &node->join_timer) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create timer.");
-        return;
+    timer->expires = wheel_tick_now() + (uint32_t)(ticks < WHEEL_SPAN ? ticks : WHEEL_SPAN);
+    if (timer->expires - wheel.now >= WHEEL_SPAN) {
+        timer->expires = wheel.now + WHEEL_SPAN - 1;
     }
-}
-
-void init_table(LinkTable* table) {
-    // NOTE: Method assumes table has ALREADY been zero-initialized.
+    wheel_place(timer);
 
-    esp_timer_create_args_t timer_init = {};
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (i == 0) {
-            timer_init.callback = timer_cb_upstream;
-            timer_init.name = "UpStreamDecay";
-        }
-        else {
-            timer_init.callback = timer_cb_downstream;
-            timer_init.name = "DownStreamDecay";
-        }
-        // NOTE: We stash the INDEX of the relevant entry in the timer cb argument.
-        timer_init.arg = (void*)i;
-        timer_init.dispatch_method = ESP_TIMER_TASK;
+    // Due before the inbound worker next wakes up: have it look again.
+    int early = (int32_t)(timer->expires - wheel.wake) < 0;
+    if (early) {
+        wheel.wake = timer->expires;
+    }
+    xSemaphoreGive(wheel.lock);
 
-        if (esp_timer_create(&timer_init, &(table->entry[i].timer)) != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to create virtual link timer.");
-            return;
-        }
+    if (early && node.svc_inbound != NULL && xTaskGetCurrentTaskHandle() != node.svc_inbound) {
+        xTaskNotifyGive(node.svc_inbound);
     }
 }
 
-void init_hooks(AppTable* table) {
-    // NOTE: Method assumes table has ALREADY been zero-initialized.
-
-    table->lock = xSemaphoreCreateBinary();
-    if (table->lock == NULL) {
-        ESP_LOGE(TAG, "Failed to initialize app table semaphore.");
-        return;
+/*
+* Method stops a timer, if it is started.
+*/
+void wheel_stop(WheelTimer* timer) {
+    while (xSemaphoreTake(wheel.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
     }
-    xSemaphoreGive(table->lock);
+    if (timer->next != NULL) {
+        wheel_unlink(timer);
+    }
+    xSemaphoreGive(wheel.lock);
 }
 
 /*
-* Method looks up the MAC address associated with a node-id in the link table.
-*  Note that this method will also check the broadcast id and any pending link
-*  node-id.
-* Returns NULL on failure.
+* Method adds a timer to its slot: on the inner level if due within one
+*  revolution, else on the outer level until wheel_run(..) cascades it.
+*  Caller holds the wheel lock.
 */
-const uint8_t* find_mac(NodeId id) {
-    if (id == link_broadcast.id) {
-        return link_broadcast.mac;
+void wheel_place(WheelTimer* timer) {
+    WheelTimer* head;
+    if (timer->expires - wheel.now < WHEEL_SLOTS) {
+        int i = timer->expires % WHEEL_SLOTS;
+        head = &wheel.slot[0][i];
+        wheel.occupied[i / 32] |= 1u << (i % 32);
     }
-    else if (id == node.pending_id) {
-        return node.pending_mac;
+    else {
+        head = &wheel.slot[1][(timer->expires / WHEEL_SLOTS) % WHEEL_SLOTS];
     }
 
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (node.link_table.usage & (1ul << i) && node.link_table.entry[i].id == id) {
-            return node.link_table.entry[i].mac;
-        }
-    }
-    return NULL;
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
 }
 
 /*
-* Method looks up the node-id associated with a MAC address in the link table.
-*  Note that method also checks broadcast MAC and pending link MAC.
-* Returns 0 on failure.
+* Method takes a started timer out of its list.  Caller holds the wheel lock.
 */
-NodeId find_id(const uint8_t* mac) {
-    if (cmp_mac(mac, link_broadcast.mac)) {
-        return link_broadcast.id;
+void wheel_unlink(WheelTimer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+
+    int i = timer->expires % WHEEL_SLOTS;
+    if (wheel.slot[0][i].next == &wheel.slot[0][i]) {
+        wheel.occupied[i / 32] &= ~(1u << (i % 32));
     }
-    else if (cmp_mac(mac, node.pending_mac)) {
-        return node.pending_id;
+}
+
+/*
+* Method advances the wheel to the current tick, calling the callback of every
+*  timer which has come due.  Runs on the inbound worker; callbacks are called
+*  without the lock held, so they may start and stop timers.
+*/
+void wheel_run() {
+    WheelTimer due;
+
+    while (xSemaphoreTake(wheel.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
     }
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (node.link_table.usage & (1ul << i)) {
-            if (cmp_mac(mac, node.link_table.entry[i].mac)) {
-                return node.link_table.entry[i].id;
+    uint32_t target = wheel_tick_now();
+    while ((int32_t)(target - wheel.now) > 0) {
+        wheel.now++;
+
+        // Each revolution of the inner level, move the next outer slot in.
+        if (wheel.now % WHEEL_SLOTS == 0) {
+            WheelTimer* head = &wheel.slot[1][(wheel.now / WHEEL_SLOTS) % WHEEL_SLOTS];
+            WheelTimer* timer = head->next;
+            head->next = head->prev = head;
+            while (timer != head) {
+                WheelTimer* next = timer->next;
+                wheel_place(timer);
+                timer = next;
+            }
+        }
+
+        int i = wheel.now % WHEEL_SLOTS;
+        WheelTimer* head = &wheel.slot[0][i];
+        if (head->next == head) {
+            continue;
+        }
+
+        // Take the whole slot, so timers started by the callbacks wait their turn.
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        wheel.occupied[i / 32] &= ~(1u << (i % 32));
+
+        while (due.next != &due) {
+            WheelTimer* timer = due.next;
+            wheel_unlink(timer);
+            wheel.fired++;
+
+            xSemaphoreGive(wheel.lock);
+            timer->callback(timer->arg);
+            while (xSemaphoreTake(wheel.lock, WAIT_LOCK) != pdTRUE) {
+                // Spin..
             }
         }
     }
-    return 0;
+    xSemaphoreGive(wheel.lock);
 }
 
 /*
-* Method looks up the link table entry associated with a node-id.
-* Returns NULL on failure.
+* Method returns how long the inbound worker may sleep: until the next occupied
+*  inner slot, or the next cascade of the outer level, whichever comes first.
 */
-LinkEntry* find_entry(NodeId id) {
-    for (int i = 0; i < LINK_TABLE_SIZE; ++i) {
-        if (node.link_table.usage & (1ul << i) && node.link_table.entry[i].id == id) {
-            return node.link_table.entry + i;
+TickType_t wheel_wait() {
+    while (xSemaphoreTake(wheel.lock, WAIT_LOCK) != pdTRUE) {
+        // Spin..
+    }
+    uint32_t at = wheel.now % WHEEL_SLOTS;
+    uint32_t gap = WHEEL_SLOTS - at;
+    for (uint32_t i = at + 1; i < WHEEL_SLOTS; i = (i | 31) + 1) {
+        uint32_t bits = wheel.occupied[i / 32] >> (i % 32);
+        if (bits != 0) {
+            gap = i + __builtin_ctz(bits) - at;
+            break;
         }
     }
-    return NULL;
+    wheel.wake = wheel.now + gap;
+
+    // Time into the current tick, and any ticks not yet run, count against the gap.
+    int64_t elapsed = esp_timer_get_time() - wheel.start;
+    int64_t us = (int64_t)gap * WHEEL_TICK - elapsed % WHEEL_TICK
+        - (int64_t)(uint32_t)((uint32_t)(elapsed / WHEEL_TICK) - wheel.now) * WHEEL_TICK;
+    xSemaphoreGive(wheel.lock);
+
+    if (us <= 0) {
+        return 0;
+    }
+    return (TickType_t)((us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000));
 }
 
 /*
-* Method looks up the inbound packet queue associated with an app-id.
-* Returns NULL on failure.
+* Method makes sure the MAC is registered with the ESP-NOW driver before a send,
+*  renewing its place in the peer cache.  Installing a new peer first removes
+*  any idle peers, or failing that the least recently used one.
+* Returns 0 on success, non-zero if the driver rejected the peer.
 */
-QueueHandle_t find_app(uint16_t app_id) {
-    if (app_id == 0)
-        return NULL;
+int peer_install(const uint8_t* mac) {
+    uint64_t key = mac_pack(mac);
+    int64_t now = esp_timer_get_time();
 
-    QueueHandle_t result = NULL;
-
-    if (xSemaphoreTake(node.app_table.lock, WAIT_LOCK) != pdTRUE) {
-        ESP_LOGW(TAG, "Failed to acquire semaphore for app table lookup.");
-        return NULL;
+    // The broadcast peer is registered permanently at start-up.
+    if (key == link_broadcast.key) {
+        return 0;
     }
 
-    for (int i = 0; i < 32; ++i) {
-        uint32_t mask = (1ul << i);
-        if (node.app_table.usage & mask && node.app_table.apps[i].id == app_id) {
-            result = node.app_table.apps[i].inbound;
-            break;
+    int x = -1;
+    int lru = 0;
+    for (int i = 0; i < PEER_SLOTS; ++i) {
+        PeerSlot* slot = &peers.slot[i];
+        if (slot->key == key) {
+            slot->last_used = now;
+            return 0;
+        }
+        if (slot->key != 0 && now - slot->last_used > TIMEOUT_PEER_IDLE) {
+            esp_now_del_peer(slot->mac);
+            slot->key = 0;
+            peers.evicted++;
+        }
+        if (slot->key == 0) {
+            if (x < 0) {
+                x = i;
+            }
+        }
+        else if (slot->last_used < peers.slot[lru].last_used || peers.slot[lru].key == 0) {
+            lru = i;
         }
     }
-    xSemaphoreGive(node.app_table.lock);
-    return result;
-}
-
-
-void net_send_raw(NetFrame* frame) {
-    assert(frame != NULL);
 
-    // Simple validation -- any outbound packets must have as a destination
-    //  a node-id associated with one of our virtual links, or the broadcast
-    //  address.
-    assert(is_linked(frame->head.destination) || 
-        frame->head.destination == link_broadcast.id ||
-        frame->head.destination == node.pending_id);
+    if (x < 0) {
+        x = lru;
+        esp_now_del_peer(peers.slot[x].mac);
+        peers.slot[x].key = 0;
+        peers.evicted++;
+    }
 
-    if (xQueueSend(outbound, frame, 0) != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to send packet -- outbound queue full.");
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, mac, 6);
+    peerInfo.channel = 0;
+    peerInfo.ifidx = ESP_IF_WIFI_STA;
+    peerInfo.encrypt = false;
+    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
+        return -1;
     }
+
+    PeerSlot* slot = &peers.slot[x];
+    slot->key = key;
+    memcpy(slot->mac, mac, 6);
+    slot->last_used = now;
+    peers.installed++;
+    return 0;
 }
 
 /*
@@ -1104,17 +4127,38 @@ void net_send_raw(NetFrame* frame) {
 *  to the outbound queue.  All items on the outbound queue are assumed to be valid.
 */
 void worker_send(void* param) {
-    NetFrame packet = {};
+    OutboundItem item = {};
     while (1) {
-        while (xQueueReceive(outbound, &packet, UINT32_MAX) != pdTRUE) {
+        while (xSemaphoreTake(outbound_ready, UINT32_MAX) != pdTRUE) {
             // Spin.
         }
 
-        // Add a minor random delay to packet transmission to mitigate spiky traffic.
-        vTaskDelay(((esp_random() % WINDOW_SEND) / 1000) / portTICK_RATE_MS);
+        // Frames held back by their bucket go first, as far as it now admits them.
+        outbound_retry();
 
-        if (esp_now_send(find_mac(packet.head.destination), (const uint8_t*)&packet, sizeof(NetFrame)) != ESP_OK) {
-            ESP_LOGE(TAG, "Packet send failure.");
+        // Strict priority: take the next item from the highest class that has one.
+        //  There is one semaphore count per item, plus one per deferral timer
+        //  wake-up, which may find none.
+        int c = 0;
+        while (c < TRAFFIC_CLASSES && xQueueReceive(outbound[c].queue, &item, 0) != pdTRUE) {
+            c++;
+        }
+        if (c == TRAFFIC_CLASSES) {
+            continue;
+        }
+        outbound[c].sent++;
+
+        // A data frame whose bucket does not admit it yet waits on the side, so
+        //  one throttled link does not hold up the others.  Control frames still
+        //  draw on the bucket, but never wait on it.
+        int64_t wait = 0;
+        if (c == CLASS_DATA) {
+            if (outbound_defer(&item) == 0) {
+                continue;
+            }
+            // No room to set it aside: wait in line, as a last resort.
+            wait = pace_delay(pace_of(item.destination), esp_timer_get_time());
         }
+        outbound_transmit(&item, wait);
     }
 }
@@ -8,19 +8,55 @@
 #include <freertos/semphr.h>
 
 #include <esp_timer.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
 
-#define PINODE_ID 0x01
+#include "network.h"
+#include "net_wire.h"
 
-#define NETWORK_TYPE 0x10
-#define NETWORK_VERSION 0x01
+#define PINODE_ID 0x01
 
-#define LINK_TABLE_SIZE 4
+// One up-stream link plus LINK_TABLE_SIZE - 1 down-stream links, at most 255.
+#define LINK_TABLE_SIZE 32
 #define LINK_UP 0
+#define LINK_WORDS ((LINK_TABLE_SIZE + 31) / 32)
+// Size of the MAC index, a power of two at least twice LINK_TABLE_SIZE.
+#define LINK_MAC_HASH 64
+#define LINK_NONE 0xFF
 
 #define INBOUND_QUEUE_SIZE 6
 
+#define APP_TABLE_SIZE 32
+#define APP_HASH_SIZE 64
+
+// Received frames awaiting dispatch, must be a power of two.
+#define RX_RING_SIZE 16
+
+// Outbound traffic classes, served in strict priority order (lowest first).
+#define CLASS_CONTROL 0
+#define CLASS_DATA 1
+#define TRAFFIC_CLASSES 2
+
+#define OUTBOUND_CONTROL_SIZE 8
+#define OUTBOUND_DATA_SIZE 16
+
+// Receive buffers, each holding one frame from the radio until it has been
+//  dispatched and the applications have released its messages.  More than
+//  RX_RING_SIZE, so a full ring leaves some for the applications.
+#define RX_BUFFER_COUNT 24
+
+// Outbound frame buffers; a multicast holds one buffer for all its queue entries.
+//  The last FRAME_RESERVE_CONTROL are kept for control frames, so a data backlog
+//  cannot starve STATUS, LINK or BLACKOUT replies.
+#define FRAME_POOL_SIZE 28
+#define FRAME_RESERVE_CONTROL OUTBOUND_CONTROL_SIZE
+
 #define LOCATE_SIZE 16
 
+// ESP-NOW driver peer slots managed by the peer cache.  The driver allows 20,
+//  one is kept for the broadcast peer and the rest left as headroom.
+#define PEER_SLOTS 16
+
 #define WAIT_LOCK ((TickType_t)(10 / portTICK_PERIOD_MS))
 
 // Microsecond timer values.
@@ -30,80 +66,284 @@
 #define WINDOW_LOCATE			(5 * US_FACTOR)
 #define TIMEOUT_LOCATE			(1 * US_FACTOR)
 
+// Direct join, to one known parent (the last one on boot, or one heard by its
+//  beacon): LOCATE sent to it only, attempts and the pause between them, before
+//  falling back to PERIOD_LOCATE.
+#define TIMEOUT_DIRECT			(250 * US_FACTOR / 1000)
+#define DIRECT_ATTEMPTS			4
+#define DIRECT_RETRY			(500 * US_FACTOR / 1000)
+
+// Beacons from linked nodes with free down-stream links, and how long an
+//  unlinked node listens after the first one it hears.
+#define PERIOD_BEACON			(3 * US_FACTOR)
+#define WINDOW_BEACON			(1 * US_FACTOR)
+#define LISTEN_BEACON			(PERIOD_BEACON + WINDOW_BEACON)
+
+// LINK proposals a node may have outstanding at once.
+#define PENDING_SLOTS			4
+
+// Last parent, kept in NVS for the warm rejoin; the leased node-id, and at the
+//  root every lease by MAC.
+#define NVS_NAMESPACE			"net"
+#define NVS_KEY_PARENT			"parent"
+#define NVS_KEY_ID				"id"
+#define NVS_KEY_LEASES			"leases"
+#define NVS_KEY_ROOT			"root"			// Set from the console, see net_root(..).
+
+// Node-ids leased by the root are LEASE_FIRST - LEASE_LAST, the ones above are
+//  provisional, derived from the MAC and used only until the lease arrives.
+#define LEASE_FIRST				0x01
+#define LEASE_LAST				0xBF
+#define LEASE_PROVISIONAL		(LEASE_LAST + 1)
+
 #define TIMEOUT_PROPOSE_LINK	(2 * US_FACTOR)
 #define TIMEOUT_STATUS			(1 * US_FACTOR)
 
 #define TIMEOUT_LINK_DECAY		(30 * US_FACTOR)
 
+// Learned routes not refreshed by traffic for this long are ignored.
+#define TIMEOUT_ROUTE			(60 * US_FACTOR)
+
+// Driver peers not sent to for this long are removed.
+#define TIMEOUT_PEER_IDLE		(60 * US_FACTOR)
+
 #define PERIOD_UP_STATUS		(15 * US_FACTOR)
 #define WINDOW_UP_STATUS		(5 * US_FACTOR)
 
-#define WINDOW_SEND				(10000)
-
-typedef uint8_t NodeId;
+// Looking for a better parent, and how much cheaper it must be to move to it.
+#define PERIOD_REOPT			(120 * US_FACTOR)
+#define WINDOW_REOPT			(30 * US_FACTOR)
+#define REOPT_MARGIN			30
+
+// Failover after losing the parent: LOCATE attempts, and the pause between
+//  them, before giving up and blacking out.
+#define ORPHAN_ATTEMPTS			5
+#define ORPHAN_RETRY			(2 * US_FACTOR)
+// Up-stream frames held while without a parent, or without credit from it.
+#define HELD_BUFFER_SIZE		6
+
+// Up-stream credit: most data frames a parent lets one child have outstanding,
+//  and how often it retries a grant it had no room for.
+#define CREDIT_WINDOW			16
+#define PERIOD_CREDIT			(20 * US_FACTOR / 1000)
+
+// Longest an application message waits in an open up-stream bundle.
+#define DEADLINE_BUNDLE			(20 * US_FACTOR / 1000)
+
+// Outbound pacing defaults, per link: sustained frames/s and burst size in frames.
+#define PACE_RATE				100
+#define PACE_BURST				8
+// Random transmit jitter (microseconds), 0 disables.
+#define PACE_JITTER				2000
+
+// Protocol timers run on the inbound worker, from a two level timing wheel of
+//  WHEEL_SLOTS slots each: WHEEL_TICK per inner slot, one inner revolution per
+//  outer slot.  Delays beyond WHEEL_SPAN ticks are clamped.
+#define WHEEL_TICK				(10 * US_FACTOR / 1000)
+#define WHEEL_SLOTS				256
+#define WHEEL_SPAN				(WHEEL_SLOTS * WHEEL_SLOTS)
+
+// Fewest children a down-stream frame is broadcast to rather than sent to each.
+#define FANOUT_MIN				3
+
+// Parent choice, see parent_cost(..): cost per hop to the root, per dBm below
+//  RSSI_GOOD, at a full outbound queue, and per child the parent already has.
+#define COST_HOP				40
+#define COST_RSSI				2
+#define COST_LOAD				40
+#define COST_SLOT				2
+#define RSSI_GOOD				(-60)
+// Assumed when no signal strength was captured for a proposal.
+#define RSSI_UNKNOWN			(-75)
+// The ESP-NOW receive callback (IDF v4.3) reports no signal strength.  With
+//  NET_RSSI_PROMISC set, promiscuous mode (management frames only) is enabled
+//  to read it; clear it to leave the radio alone, parent choice then assumes
+//  RSSI_UNKNOWN throughout.
+#define NET_RSSI_PROMISC		1
+// Assumed for proposals from nodes which send no hints.
+#define HOPS_UNKNOWN			3
+
+// Timer on the timing wheel, a member of one slot's list while started.
+typedef struct WheelTimer {
+	struct WheelTimer*	next;		// NULL while stopped.
+	struct WheelTimer*	prev;
+	uint32_t			expires;	// Wheel tick it is due at.
+	void				(*callback)(void* arg);
+	void*				arg;
+} WheelTimer;
+
+typedef struct TimerWheel {
+	WheelTimer			slot[2][WHEEL_SLOTS];		// List heads, inner and outer level.
+	uint32_t			occupied[WHEEL_SLOTS / 32];	// Inner slots with timers.
+	uint32_t			now;			// Last tick processed.
+	uint32_t			wake;			// Tick the worker sleeps until.
+	int64_t				start;			// Time of tick 0.
+	uint32_t			fired;
+	SemaphoreHandle_t	lock;
+} TimerWheel;
+
+// Token bucket kept as a theoretical arrival time (GCRA).
+typedef struct Pacer {
+	uint16_t rate;
+	uint16_t burst;
+	int64_t tat;
+} Pacer;
 
 typedef struct LinkEntry {
 	uint8_t mac[6];
+	uint64_t key;			// The MAC packed by mac_pack(..), for comparisons.
 	NodeId id;
-	esp_timer_handle_t timer;
+	uint8_t version;		// Wire format understood by the peer.
+	uint8_t advertised;		// Non-zero once the child has sent its interest.
+	uint64_t interest;		// Summary of the app-ids run in the child's subtree.
+	WheelTimer timer;
+	int64_t last_rx;		// Any valid frame from the peer, proof that it is alive.
+	int64_t last_tx;		// Last frame the peer acknowledged, see espnow_sent(..).
+	Pacer pace;
+	// Up-stream credit, see credit_grant(..).  Sequence numbers count data frames
+	//  sent to the parent, the limit is the last one it accepts.
+	uint8_t credited;		// Up-stream: non-zero once the parent grants credit.
+	uint8_t credit_seq;		// Last data frame sent (up-stream) or received (down-stream).
+	uint8_t credit_limit;
+	uint8_t starved;		// Down-stream: owed a grant there was no room for.
 } LinkEntry;
 
+// Route to a node in the subtree below this one, indexed by its node-id.
+typedef struct RouteEntry {
+	NodeId via;				// Down-stream link towards the node, 0 if unknown.
+	int64_t seen;
+} RouteEntry;
+
 typedef struct LinkTable {
 	LinkEntry entry[LINK_TABLE_SIZE];
-	uint32_t usage;
+	uint32_t usage[LINK_WORDS];
+	uint8_t by_id[256];				// Entry index per node-id, LINK_NONE if not linked.
+	uint8_t by_mac[LINK_MAC_HASH];	// Entry indices, open addressed on the packed MAC.
 } LinkTable;
 
 typedef struct AppQueue {
 	uint16_t        id;
 	QueueHandle_t   inbound;
+	net_handler_t   handler;    // NULL if the app receives by itself.
+	void*           ctx;
+	uint32_t*       waiting;    // Receivers blocked on inbound, see net_unregister_app(..).
 } AppQueue;
 
+// Open addressed on the app-id, kept at most half full.  Id 0 marks a free slot.
+typedef struct AppSnapshot {
+	AppQueue            apps[APP_HASH_SIZE];
+	uint32_t            count;
+} AppSnapshot;
+
+/*
+* Read-mostly application table.  Readers look up the published snapshot without
+*  locking, writers build a new snapshot in the spare buffer and publish it with
+*  an atomic pointer swap, then wait for in-flight readers to leave before the
+*  old one may be reused.
+*/
 typedef struct AppTable {
-	uint32_t            usage;
-	AppQueue            apps[32];
-	SemaphoreHandle_t   lock;
+	AppSnapshot*        current;
+	AppSnapshot         snap[2];
+	uint32_t            readers;
+	SemaphoreHandle_t   lock;       // Serializes writers only.
 } AppTable;
 
+// LINK proposal received while locating, with the proposer's hints.  Also the
+//  NVS record of the last parent.
+typedef struct Proposal {
+	uint8_t mac[6];
+	NodeId id;
+	uint8_t hops;		// Proposer's distance from the root.
+	uint8_t slots;		// Free down-stream links, 0 if no hints were sent.
+	uint8_t load;		// Outbound data queue occupancy, 0 - 255.
+	int8_t rssi;		// dBm, 0 if unknown.
+} Proposal;
+
+// LINK proposal sent to a joining node, reserving a down-stream link.
+typedef struct PendingLink {
+	uint8_t mac[6];
+	NodeId id;				// 0 if the slot is free.
+	int64_t expires;
+} PendingLink;
+
 typedef struct NodeState {
 	int			isRoot;
 	NodeId		id;
+	uint8_t		depth;		// Hops to the root, 0 at the root.
 	LinkTable	link_table;
 	AppTable	app_table;
 	uint32_t	flags;
 	
 	uint8_t		loc_ident;
-	LinkEntry	loc_response[LOCATE_SIZE];
+	Proposal	loc_response[LOCATE_SIZE];
 	uint32_t	loc_count;
-	esp_timer_handle_t loc_timer;
-
-	uint8_t				pending_mac[6];
-	NodeId				pending_id;
-	esp_timer_handle_t	pending_timer;
-
-	esp_timer_handle_t status_timer;
-	esp_timer_handle_t join_timer;
+	WheelTimer loc_timer;
+
+	PendingLink	pending[PENDING_SLOTS];	// LINK proposals awaiting confirmation.
+	Proposal	direct;					// Target of a direct join.
+
+	WheelTimer beacon_timer;
+	WheelTimer listen_timer;
+
+	WheelTimer status_timer;
+	WheelTimer join_timer;
+
+	Proposal	parent;		// Hints of the current parent, for re-optimisation.
+	Proposal	former;		// Parent being left, id 0 if none.
+	WheelTimer reopt_timer;
+
+	QueueHandle_t	held_queue;		// Up-stream frames held while orphaned or out of credit.
+	uint8_t			orphan_tries;
+	uint8_t			direct_tries;
+	uint32_t		orphaned;		// Parents lost and replaced.
+	uint32_t		orphan_lost;	// Held frames dropped, buffer full.
+	uint32_t		throttled;		// Up-stream messages refused for lack of credit.
+	uint32_t		status_sent;	// Up-stream STATUS checks made, the link being idle.
+	uint32_t		status_skipped;	// Checks left out, traffic both ways showed the link alive.
+	WheelTimer	credit_timer;
+	SemaphoreHandle_t	credit_ready;	// Given when held frames leave, see net_send_up_wait(..).
+	int64_t		credit_asked;	// Last STATUS sent to ask for credit, see credit_request(..).
+
+	int			dynamic_id;		// Node-id is leased from the root, see lease_request(..).
+	uint32_t	leases;			// At the root: node-ids leased out.
+
+	uint64_t	interest_sent;	// Summary last advertised up-stream.
+	uint32_t	pruned;			// Down-stream copies skipped for lack of interest.
+	uint32_t	fanned;			// Down-stream frames sent as a single broadcast.
+
+	Pacer pace_default;		// Template for new links, also paces broadcast / pending.
+	esp_timer_handle_t pace_timer;
+	esp_timer_handle_t defer_timer;
+
+	struct NetFrame*	bundle;			// Open up-stream bundle, NULL if none.
+	uint8_t				bundle_count;
+	WheelTimer	bundle_timer;
+	SemaphoreHandle_t	up_lock;		// Guards the bundle, held frames and up-stream credit.
+
+	Proposal	unsaved;		// Parent for svc_store to record, see parent_save(..).
+	NodeId		unsaved_id;		// Node-id for svc_store to record, see id_save(..).
+	int			store_pending;	// STORE_* flags, what svc_store has left to record.
+	SemaphoreHandle_t	store_lock;		// Guards the above.
 
 	TaskHandle_t svc_outbound;
+	TaskHandle_t svc_inbound;
+	TaskHandle_t svc_apps;
+	TaskHandle_t svc_store;
 } NodeState;
 
 #define STATE_LOCATING (1ul << 0)
-#define STATE_PENDING_LINK (1ul << 1)
 #define STATE_UPLINK_STATUS (1ul << 2)
 #define STATE_FROZEN (1ul << 3)
+#define STATE_REOPT (1ul << 4)			// Locating a better parent, already linked.
+#define STATE_MIGRATING (1ul << 5)		// New parent linked, awaiting its STATUS.
+#define STATE_ORPHAN (1ul << 6)			// Parent lost, children kept, locating.
+#define STATE_DIRECT (1ul << 7)			// Locating one known parent only, see direct_begin(..).
+#define STATE_LISTENING (1ul << 8)		// Collecting beacons, see beacon_heard(..).
+#define STATE_UNLEASED (1ul << 9)		// Provisional node-id, no lease from the root yet.
 
-typedef struct NetFrameHeader {
-	uint8_t version;
-	NodeId source;
-	NodeId destination;
-	uint8_t checksum;
-	uint8_t control;
-	uint8_t reserved[11];
-} NetFrameHeader;
-
-#define RES_CONTROL 0
-#define RES_IDENT 1
-#define RES_ORIGIN 1
-#define RES_UPSTREAM 2
+#define STORE_PARENT (1 << 0)
+#define STORE_LEASES (1 << 1)
+#define STORE_ID (1 << 2)
 
 #define CONTROL_DEFAULT 0
 #define CONTROL_LOCATE 1
@@ -112,11 +352,117 @@ typedef struct NetFrameHeader {
 #define CONTROL_MAP 4
 #define CONTROL_BLACKOUT 5
 #define CONTROL_FREEZE 6
+// Several application messages, each app_header_t followed by its payload.
+#define CONTROL_BUNDLE 7
+// One application message for the node in RES_TARGET.
+#define CONTROL_UNICAST 8
+// Interest summary of the sender's subtree, see interest_summary(..).
+#define CONTROL_SUBSCRIBE 9
+// One broadcast frame for several children, see fanout_wrap(..).
+#define CONTROL_FANOUT 10
+// Child leaves for another parent.
+#define CONTROL_UNLINK 11
+// Node-ids now reached through the sender, one per byte of contents.
+#define CONTROL_ROUTES 12
+// Parent moved, its link hints follow.
+#define CONTROL_MOVED 13
+// Linked node with free down-stream links, its link hints follow.
+#define CONTROL_BEACON 14
+// Node-id lease for the MAC in contents: requested up-stream (RES_TARGET 0,
+//  requester in RES_ORIGIN), granted down to the requester in RES_TARGET.
+#define CONTROL_LEASE 15
+// Up-stream credit for the receiver, up to data frame RES_CREDIT.  The sender
+//  of data frames up-stream puts their sequence number in RES_CREDIT.
+#define CONTROL_CREDIT 16
+
+// Network layer use of app_header_t.reserved, which applications must leave be.
+#define APP_RES_DIRECTION 0		// On delivery: 0x01 if from up-stream, else 0x00.
+#define APP_RES_ORIGIN 1		// Node the message was first sent from.
+#define APP_RES_FLAGS 2			// NET_SEND_* flags given by the sender.
+
+// Link hints, in the contents of LINK proposals and STATUS responses.
+#define HINT_HOPS 0				// Sender's hops to the root.
+#define HINT_SLOTS 1			// Sender's free down-stream links.
+#define HINT_LOAD 2				// Sender's outbound data queue occupancy, 0 - 255.
+#define HINT_SIZE 3
+
+// Contents of CONTROL_LEASE.
+#define LEASE_MAC 0				// Requester's MAC.
+#define LEASE_ID 6				// Request: node-id held (0 if provisional); grant: node-id leased, 0 if none free.
+#define LEASE_SIZE 7
+
+typedef struct PoolFrame {
+	NetFrame frame;		// Must remain the first member.
+	uint32_t refs;
+} PoolFrame;
+
+// Outbound queue entry -- the destination is patched into the frame at transmit.
+typedef struct OutboundItem {
+	NetFrame* frame;
+	NodeId destination;
+} OutboundItem;
 
-typedef struct NetFrame {
-	NetFrameHeader head;
-	uint8_t contents[136];
-} NetFrame;
+typedef struct PeerSlot {
+	uint64_t key;			// Packed MAC, zero if the slot is free.
+	uint8_t mac[6];
+	int64_t last_used;
+} PeerSlot;
+
+// Driver peers, installed by the outbound worker on demand and evicted in LRU
+//  order; only that task touches the cache.
+typedef struct PeerCache {
+	PeerSlot slot[PEER_SLOTS];
+	uint32_t installed;
+	uint32_t evicted;
+} PeerCache;
+
+// Signal strength of the last ESP-NOW frame seen by promisc_recv(..).  A sequence
+//  lock, in case the two callbacks ever run on different tasks.
+typedef struct RssiNote {
+	uint32_t seq;		// Odd while promisc_recv(..) writes.
+	uint8_t mac[6];		// Transmitter.
+	int8_t rssi;
+} RssiNote;
+
+// One received frame.  The radio's bytes are copied in once, by espnow_recv(..),
+//  decoded in place (see wire_place(..)), and the application messages in it
+//  are lent out as they are, see deliver_app(..).  Word aligned, as is a
+//  message starting the contents: applications cast the payload straight to
+//  their packet structs.
+typedef struct RxBuffer {
+	NetFrame frame;
+	uint32_t refs;		// The inbound worker's, plus one per message lent out.
+	uint8_t mac[6];		// Sender.
+	uint8_t len;		// Wire length.
+	uint8_t format;		// First wire byte, see wire_place(..).
+	int8_t rssi;		// dBm, 0 if unknown.
+} __attribute__((aligned(4))) RxBuffer;
+
+// Application message lent out, as queued for its application.
+typedef struct RxMessage {
+	RxBuffer* buffer;	// NULL wakes a receiver, see net_unregister_app(..).
+	app_header_t* head;	// Inside the buffer's frame.
+} RxMessage;
+
+// Single producer (the Wi-Fi callback), single consumer (svc_inbound) ring.
+typedef struct RxRing {
+	RxBuffer* slot[RX_RING_SIZE];
+	uint32_t head;		// Written by the producer only.
+	uint32_t tail;		// Written by the consumer only.
+	uint32_t received;
+	uint32_t dropped;
+	uint32_t starved;	// Packets lost to an empty receive buffer pool.
+	uint32_t high_water;
+} RxRing;
+
+typedef struct OutboundClass {
+	QueueHandle_t queue;
+	uint32_t depth;
+	uint32_t sent;
+	uint32_t dropped;
+	uint32_t deferred;	// Held back by their link's bucket, see outbound_defer(..).
+	uint32_t high_water;
+} OutboundClass;
 
 
 // Clearinghouse for internal methods.
@@ -125,7 +471,6 @@ void init_node(NodeState* node, NodeId id);
 void init_table(LinkTable* table);
 void init_hooks(AppTable* table);
 
-int valid_packet(const uint8_t* mac, const uint8_t* data, int len);
 int valid_link(const uint8_t* mac, NodeId node);
 
 int is_linked(NodeId id);
@@ -136,31 +481,158 @@ const uint8_t* find_mac(NodeId id);
 NodeId find_id(const uint8_t* mac);
 LinkEntry* find_entry(NodeId id);
 QueueHandle_t find_app(uint16_t app_id);
+const AppQueue* app_lookup(uint16_t app_id);
+int app_probe(const AppSnapshot* snap, uint16_t app_id);
+void app_read_lock();
+void app_read_unlock();
+int app_register(uint16_t app_id, net_handler_t handler, void* ctx);
+void app_publish(AppTable* table, const AppQueue* add, uint16_t remove_id);
+
+int link_used(const LinkTable* table, int x);
+void link_insert(LinkTable* table, int x);
+void link_remove(LinkTable* table, int x);
+int link_by_mac(const LinkTable* table, uint64_t key);
+uint64_t mac_pack(const uint8_t* mac);
 
 int has_uplink(const LinkTable* table);
+int count_downlinks(const LinkTable* table);
+void link_hints(NetFrame* frame);
+int has_hints(const NetFrame* frame, uint8_t version);
+int parent_cost(const Proposal* p);
+void send_locate();
+int reopt_choose();
+void migrate_uplink(const Proposal* p);
+void migrate_done();
+void migrate_revert();
+void uplink_adopt(const Proposal* p);
+void send_moved();
+void orphan_begin();
+int orphan_choose();
+void orphan_hold(NetFrame* frame);
+void uplink_release();
+int uplink_send(NetFrame* frame);
+int uplink_ready();
+int uplink_starved();
+void credit_request();
+void credit_received(LinkEntry* link, uint8_t seq);
+void credit_grant(LinkEntry* link);
+int credit_window();
+int rejoin_begin();
+void direct_begin(const Proposal* p);
+void beacon_heard(const uint8_t* mac, NodeId id, int8_t rssi, const uint8_t* hints);
+int pending_add(NodeId id, const uint8_t* mac);
+PendingLink* pending_find(NodeId id);
+int pending_count();
+void parent_save(const Proposal* p);
+void store_flush();
+int parent_write(const Proposal* p);
+int parent_load(Proposal* p);
+NodeId lease_start();
+void lease_request();
+void lease_forward(NetFrame* frame);
+void lease_adopt(NodeId id);
+NodeId lease_grant(const uint8_t* mac, NodeId held);
+int lease_load();
+void lease_save();
+int lease_write();
+void id_save(NodeId id);
+int id_write(NodeId id);
+int id_load(NodeId* id);
+void link_rename(LinkTable* table, int x, NodeId id);
 int has_available_downlinks(const LinkTable* table);
 int form_uplink(LinkTable* table, const uint8_t* mac, NodeId id);
 int form_downlink(LinkTable* table, const uint8_t* mac, NodeId id);
 
-uint8_t pak_checksum(const NetFrame* frame);
 
 int cmp_mac(const uint8_t* mac_a, const uint8_t* mac_b);
 
+// Pooled outbound frames.
+NetFrame* frame_alloc(int cls);
+int frame_class(const NetFrame* frame);
+void frame_retain(NetFrame* frame);
+void frame_release(NetFrame* frame);
+
+// Pooled receive buffers.
+RxBuffer* rx_alloc();
+void rx_retain(RxBuffer* buffer);
+void rx_release(RxBuffer* buffer);
+
 // Packet sending interface?
 void net_send_raw(NetFrame* frame);
+int net_send_frame(NetFrame* frame, NodeId destination);
+void net_send_downlinks(NetFrame* frame);
+void net_send_subscribed(NetFrame* frame, uint16_t app_id, int flags);
+NetFrame* fanout_wrap(const NetFrame* frame, const NodeId* ids, int count);
+int fanout_unwrap(NetFrame* frame, NodeId id);
+
+uint64_t app_bloom(uint16_t app_id);
+uint64_t interest_summary();
+void subscribe_update(int force);
+
+int send_up(const app_header_t* head, const uint8_t* data, NodeId origin);
+int send_down(const app_header_t* head, const uint8_t* data, int flags);
+int deliver_app(RxBuffer* rx, NodeId src, const uint8_t* pkt);
+
+void route_learn(NodeId id, NodeId via);
+NodeId route_lookup(NodeId id);
+void route_forward(NetFrame* frame, NodeId src);
+void route_announce();
+
+int bundle_append(const app_header_t* head, const uint8_t* data);
+void bundle_flush();
+void dispatch_app(RxBuffer* rx, NodeId src, const uint8_t* pkt);
 
 void worker_send(void* param);
+int peer_install(const uint8_t* mac);
+void worker_recv(void* param);
+void worker_apps(void* param);
+void worker_store(void* param);
+void net_dispatch(RxBuffer* rx);
+void espnow_sent(const uint8_t* mac, esp_now_send_status_t status);
+void promisc_recv(void* buf, wifi_promiscuous_pkt_type_t type);
+int8_t rssi_take(const uint8_t* mac);
+
+int net_set_pacing(NodeId id, uint16_t rate, uint16_t burst);
+void pace_init(Pacer* pace, const Pacer* from);
+int64_t pace_delay(const Pacer* pace, int64_t now);
+void pace_commit(Pacer* pace, int64_t now);
+void pace_sleep(int64_t us);
+Pacer* pace_of(NodeId id);
+int outbound_defer(const OutboundItem* item);
+void outbound_retry();
+void outbound_transmit(OutboundItem* item, int64_t wait);
 
 // Control packet handlers.
 void exec_blackout();
 
 
 // Callback methods for various timers.
-void timer_cb_pending_link(void* param);
 void timer_cb_locating(void* param);
 void timer_cb_up_status(void* param);
 void timer_cb_upstream(void* param);
 void timer_cb_downstream(void* param);
 void timer_cb_join(void* param);
-
-void net_table();
\ No newline at end of file
+void timer_cb_reopt(void* param);
+void timer_cb_beacon(void* param);
+void timer_cb_listen(void* param);
+void timer_cb_pace(void* param);
+void timer_cb_defer(void* param);
+void timer_cb_bundle(void* param);
+void timer_cb_credit(void* param);
+
+// Timing wheel.
+void wheel_setup();
+void wheel_timer_init(WheelTimer* timer, void (*callback)(void*), void* arg);
+void wheel_start(WheelTimer* timer, uint64_t us);
+void wheel_stop(WheelTimer* timer);
+void wheel_place(WheelTimer* timer);
+void wheel_unlink(WheelTimer* timer);
+void wheel_run();
+TickType_t wheel_wait();
+uint32_t wheel_tick_now();
+
+void net_table();
+void net_stats();
+void net_root(const char* arg);
+int net_root_load();
+int net_root_save(int root);
\ No newline at end of file
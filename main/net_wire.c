@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "net_wire.h"
+
+/*
+* Method unpacks a received frame of either wire format into the in-memory
+*  layout.  Returns the wire format version, or zero if the packet is obviously
+*  invalid or malformed.
+*/
+int wire_decode(const uint8_t* data, int len, NetFrame* frame) {
+    if (len < COMPACT_HEADER_SIZE || len > ESP_NOW_MAX_DATA_LEN) {
+        return 0;
+    }
+    memcpy(wire_place(frame, data[0]), data, len);
+    return wire_open(frame, len, data[0]);
+}
+
+/*
+* Method returns where in 'frame' a received packet starting with byte 'first'
+*  is copied for wire_open(..) to decode it in place: the start of the frame
+*  for the legacy format, the COMPACT_HEADER_SIZE bytes in front of the
+*  contents for the compact one.  Either way the contents land where they stay.
+*/
+uint8_t* wire_place(NetFrame* frame, uint8_t first) {
+    if (first == (NETWORK_TYPE | NETWORK_VERSION_COMPACT)) {
+        return frame->contents - COMPACT_HEADER_SIZE;
+    }
+    return (uint8_t*)frame;
+}
+
+/*
+* Method decodes, in place, a received packet of 'len' bytes starting with byte
+*  'first', copied to wire_place(..).  Returns the wire format version, or zero
+*  if the packet is obviously invalid or malformed.
+*/
+int wire_open(NetFrame* frame, int len, uint8_t first) {
+    const uint8_t* data = wire_place(frame, first);
+    if (len < COMPACT_HEADER_SIZE || len > ESP_NOW_MAX_DATA_LEN || (first & 0xF0) != NETWORK_TYPE) {
+        return 0;
+    }
+
+    if (first == (NETWORK_TYPE | NETWORK_VERSION)) {
+        if (len != LEGACY_FRAME_SIZE || data[3] != pak_checksum(data, len)) {
+            return 0;
+        }
+        frame->head.reserved[RES_LENGTH] = LEGACY_CONTENTS;
+        return NETWORK_VERSION;
+    }
+
+    if (first == (NETWORK_TYPE | NETWORK_VERSION_COMPACT)) {
+        if (len != COMPACT_HEADER_SIZE + data[5] || data[3] != pak_checksum(data, len)) {
+            return 0;
+        }
+        // The compact header overlays the tail of the full one.
+        uint8_t h[COMPACT_HEADER_SIZE];
+        memcpy(h, data, COMPACT_HEADER_SIZE);
+
+        memset(&frame->head, 0, sizeof(NetFrameHeader));
+        frame->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+        frame->head.source = h[1];
+        frame->head.destination = h[2];
+        frame->head.control = h[4];
+        frame->head.reserved[RES_LENGTH] = h[5];
+        frame->head.reserved[RES_IDENT] = h[6];
+        frame->head.reserved[RES_UPSTREAM] = h[7];
+        return NETWORK_VERSION_COMPACT;
+    }
+    return 0;
+}
+
+/*
+* Method prepares a pooled frame for transmission to one destination and points
+*  'wire' at the bytes to send.  For the compact format the header is written
+*  over the tail of the full header, directly in front of the contents; the
+*  caller must restore those bytes (see worker_send) if the frame is shared.
+* Returns the wire length, or negative if the frame does not fit the format.
+*/
+int wire_encode(NetFrame* frame, NodeId destination, uint8_t version, const uint8_t** wire) {
+    uint8_t length = frame->head.reserved[RES_LENGTH];
+
+    frame->head.destination = destination;
+    if (version == NETWORK_VERSION_COMPACT) {
+        uint8_t* h = frame->contents - COMPACT_HEADER_SIZE;
+        uint8_t ident = frame->head.reserved[RES_IDENT];
+        uint8_t upstream = frame->head.reserved[RES_UPSTREAM];
+
+        h[0] = (NETWORK_TYPE | NETWORK_VERSION_COMPACT);
+        h[1] = frame->head.source;
+        h[2] = destination;
+        h[4] = frame->head.control;
+        h[5] = length;
+        h[6] = ident;
+        h[7] = upstream;
+        h[3] = pak_checksum(h, COMPACT_HEADER_SIZE + length);
+        *wire = h;
+        return COMPACT_HEADER_SIZE + length;
+    }
+
+    if (length > LEGACY_CONTENTS) {
+        return -1;
+    }
+    frame->head.reserved[RES_CAPS] |= CAPS_COMPACT;
+    frame->head.checksum = pak_checksum((const uint8_t*)frame, LEGACY_FRAME_SIZE);
+    *wire = (const uint8_t*)frame;
+    return LEGACY_FRAME_SIZE;
+}
+
+/*
+* Checksum over a wire frame of either format; the checksum byte itself sits at
+*  the same offset in both headers and is skipped.
+*/
+uint8_t pak_checksum(const uint8_t* data, int len) {
+    int offset_check = 3;
+
+    uint8_t  balance = 0;
+    const uint8_t* work = data;
+
+    for (int i = 0; i < len; ++i) {
+        if (i != offset_check) {
+            balance = balance ^ work[i];
+        }
+    }
+    return balance;
+}
@@ -0,0 +1,72 @@
+/*
+ *  Network layer frames and their two wire formats.  Kept apart from
+ *  net_layer.h, free of FreeRTOS and ESP-IDF, so host tools can link
+ *  net_wire.c.
+ */
+
+#ifndef INCL_NET_WIRE_H
+#define INCL_NET_WIRE_H
+
+#include <stdint.h>
+
+// As in esp_now.h, which host builds do not have.
+#ifndef ESP_NOW_MAX_DATA_LEN
+#define ESP_NOW_MAX_DATA_LEN 250
+#endif
+
+#define NETWORK_TYPE 0x10
+#define NETWORK_VERSION 0x01
+// Variable-length frames with the trimmed 8 byte header.
+#define NETWORK_VERSION_COMPACT 0x02
+
+typedef uint8_t NodeId;
+
+typedef struct NetFrameHeader {
+	uint8_t version;
+	NodeId source;
+	NodeId destination;
+	uint8_t checksum;
+	uint8_t control;
+	uint8_t reserved[11];
+} NetFrameHeader;
+
+#define RES_CONTROL 0
+#define RES_IDENT 1
+#define RES_ORIGIN 1
+#define RES_CREDIT 1
+#define RES_UPSTREAM 2
+#define RES_TARGET 2
+#define RES_CAPS 9
+#define RES_LENGTH 10
+
+// Capability bits announced in RES_CAPS of legacy frames.
+#define CAPS_COMPACT (1u << 0)
+#define CAPS_HINTS (1u << 1)		// Contents start with link hints, see link_hints(..).
+
+/*
+* Wire formats:
+*  - legacy (NETWORK_VERSION): the full header plus 136 bytes of contents, always
+*    LEGACY_FRAME_SIZE bytes.
+*  - compact (NETWORK_VERSION_COMPACT): version, source, destination, checksum,
+*    control, length, RES_IDENT and RES_UPSTREAM, followed by only the used bytes
+*    of contents.  Sent only to peers that have announced CAPS_COMPACT.
+* In memory the compact header is laid over the tail of the full header at
+*  transmit, so neither format needs the contents copied.
+*/
+#define LEGACY_CONTENTS 136
+#define LEGACY_FRAME_SIZE (sizeof(NetFrameHeader) + LEGACY_CONTENTS)
+#define COMPACT_HEADER_SIZE 8
+#define FRAME_CONTENTS (ESP_NOW_MAX_DATA_LEN - COMPACT_HEADER_SIZE)
+
+typedef struct NetFrame {
+	NetFrameHeader head;	// Used bytes of contents are kept in reserved[RES_LENGTH].
+	uint8_t contents[FRAME_CONTENTS];
+} NetFrame;
+
+int wire_decode(const uint8_t* data, int len, NetFrame* frame);
+uint8_t* wire_place(NetFrame* frame, uint8_t first);
+int wire_open(NetFrame* frame, int len, uint8_t first);
+int wire_encode(NetFrame* frame, NodeId destination, uint8_t version, const uint8_t** wire);
+uint8_t pak_checksum(const uint8_t* data, int len);
+
+#endif
@@ -15,12 +15,39 @@ typedef struct  {
  * Note: app_id > 0
  */ 
 int  net_init(           uint8_t node_id, int isDebugRoot);
+
+// With node_id 0 the node-id is leased from the root once the node has
+//  joined, and kept across restarts; until then a provisional one is used.
+// - the root itself needs a fixed node_id
+// - fixed node-ids on other nodes may clash with leased ones
+uint8_t net_node_id(void);
 int  net_register_app(   uint16_t app_id);
 int  net_unregister_app( uint16_t app_id);
 int  net_send_up(  const app_header_t *head, const uint8_t *data);
+
+// Up-stream traffic is paced by the parent's credit.  Without it net_send_up
+//  holds a few messages, then refuses more with NET_WOULD_BLOCK; this variant
+//  waits for credit instead, up to timeout ms (negative means indefinitely).
+#define NET_WOULD_BLOCK (-4)
+int  net_send_up_wait(const app_header_t *head, const uint8_t *data, int32_t timeout);
 int  net_send_down(const app_header_t *head, const uint8_t *data);
 
-#define NET_MAX_PAYLOAD  128
+// As net_send_down, with NET_SEND_* flags which stay with the message as it
+//  is forwarded further down.
+// - NET_SEND_RELIABLE: one acknowledged frame per child, rather than a single
+//   broadcast frame shared by all of them (which the radio does not retry)
+#define NET_SEND_RELIABLE 0x01
+int  net_send_down_flags(const app_header_t *head, const uint8_t *data, int flags);
+
+// Sends to one node anywhere in the tree, along a single path where the route
+//  is known (learned from the node's up-stream traffic), flooding otherwise.
+// - the receiving node must have the app registered, it is not forwarded
+int  net_send_to(uint8_t node_id, const app_header_t *head, const uint8_t *data);
+
+// Payloads above NET_LEGACY_MAX_PAYLOAD only reach nodes speaking the
+//  compact frame format; they are dropped towards older nodes.
+#define NET_MAX_PAYLOAD         234
+#define NET_LEGACY_MAX_PAYLOAD  128
 
 // Blocks until viable packet is available, or timeout occurs.
 // - data pointer to an array with size NET_MAX_PAYLOAD (or more)
@@ -29,5 +56,28 @@ int  net_send_down(const app_header_t *head, const uint8_t *data);
 // - negative timeout means to wait until packet is available
 int net_receive(uint16_t app_id, app_header_t *h, uint8_t *data, int32_t timeout);
 
+// A received packet lent to the application, valid until net_release(..).
+typedef struct {
+    app_header_t *head;
+    uint8_t      *data;    /* head->len bytes */
+    void         *token;   /* do not use      */
+} net_msg_t;
+
+// As net_receive, but without copying: msg points into a network layer
+//  receive buffer which the application owns until it calls net_release(..).
+// - release promptly, the receive buffers are shared by the radio and all
+//   applications; while they are lent out, incoming frames are dropped
+int  net_receive_borrow(uint16_t app_id, net_msg_t *msg, int32_t timeout);
+void net_release(net_msg_t *msg);
+
+// Alternative to receiving: register the app with a handler, which is called
+//  on the shared app-dispatch task as soon as packets arrive.
+// - each call delivers every packet queued for the app (count >= 1), the
+//   buffers are released when the handler returns
+// - handlers must not block for long, nor (un)register applications
+// - do not call net_receive(..) on an app with a handler
+typedef void (*net_handler_t)(const net_msg_t *msgs, int count, void *ctx);
+int  net_register_app_handler(uint16_t app_id, net_handler_t cb, void *ctx);
+
     
 #endif
\ No newline at end of file
@@ -196,3 +196,89 @@ void rl_fdiv2(bigint_t *x)
         }
     }
 }
+
+
+/*
+ *  Subtraction of a "small" constant (c <= MASK)
+ *  - returns -1 if the result would be negative (x is then undefined)
+ */
+int rl_sub( bigint_t *x, uint32_t c )
+{
+    for(int i=0; i<x->len && c; i++)
+    {
+        if ( x->a[i] >= c )
+        {
+            x->a[i] -= c;
+            c = 0;
+        }
+        else
+        {
+            x->a[i] = x->a[i] + (MASK+1) - c;
+            c = 1;  /* borrow */
+        }
+    }
+    if ( c )
+        return -1;
+    while( x->len && !x->a[ x->len-1 ] )
+        x->len--;
+    return 0;
+}
+
+/*
+ *  x = m*x + c, for the parser only
+ *  - does NOT touch rl_overflow (the computation task watches it), returns non-zero instead
+ */
+static int rl_mul_add( bigint_t *x, uint32_t m, uint32_t c )
+{
+    uint64_t r = c;
+
+    for(int i=0; i<x->len; i++)
+    {
+        r += ((uint64_t)x->a[i]) * m;
+        x->a[i] = r & MASK;
+        r = r >> BLEN;
+    }
+    while( r )
+    {
+        if ( x->len >= INT_LEN )
+            return -1;
+        x->a[ x->len++ ] = r & MASK;
+        r = r >> BLEN;
+    }
+    return 0;
+}
+
+/*
+ *  Parse a decimal, or hex with the "0x" prefix, string
+ */
+int rl_parse( bigint_t *x, const char *s )
+{
+    uint32_t radix = 10;
+
+    x->len = 0;
+    if ( !s || !*s )
+        return -1;
+    if ( s[0]=='0' && (s[1]=='x' || s[1]=='X') )
+    {
+        radix = 16;
+        s += 2;
+        if ( !*s )
+            return -1;
+    }
+    for( ; *s; s++)
+    {
+        uint32_t d;
+
+        if ( *s >= '0' && *s <= '9' )
+            d = *s - '0';
+        else if ( radix==16 && *s >= 'a' && *s <= 'f' )
+            d = *s - 'a' + 10;
+        else if ( radix==16 && *s >= 'A' && *s <= 'F' )
+            d = *s - 'A' + 10;
+        else
+            return -1;
+        if ( rl_mul_add( x, radix, d ) )
+            return -1;
+    }
+    return 0;
+}
@@ -44,4 +44,7 @@ void rl_add(   bigint_t *x, uint32_t c );
 void rl_f3n1(  bigint_t *x );
 void rl_fdiv2( bigint_t *x );
 
+int  rl_sub(   bigint_t *x, uint32_t c );            /* returns -1 on underflow          */
+int  rl_parse( bigint_t *x, const char *s );         /* decimal or 0x-hex, -1 if invalid */
+
 #endif
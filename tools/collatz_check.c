@@ -0,0 +1,583 @@
+/**********************************************************/
+/*                                                        */
+/*  Host-side spot-checker for "Distributed Collatz       */
+/*  Verification" -- re-verifies blocks the mesh reports  */
+/*  as DONE, using all host cores (and AVX2 if present)   */
+/*                                                        */
+/**********************************************************/
+/*
+ * Build (from the project root):
+ *   gcc -O2 -mavx2 -pthread -Imain -o collatz_check tools/collatz_check.c main/rl_int.c
+ *
+ * Usage:
+ *   collatz_check [-b blocksize] [-s samples] [-t threads] [-v] [logfile]
+ *
+ * - Reads an ESP log (or a live `idf.py monitor` stream on stdin) and picks up
+ *   the blocks reported as done by collatz.c:
+ *     "Reporting block %d from frame 0x%s"
+ *     "Received a report for block %d frame 0x%s done"
+ *     "Shifted %d blocks, the current frame is 0x%s"
+ * - Block b of frame f covers the odd integers f+b*BLOCKSIZE+2 ... f+(b+1)*BLOCKSIZE,
+ *   exactly as compute_block() walks them, and the same "falls below the
+ *   starting value" criterion and 300 bit overflow limit of rl_int are applied.
+ * - With -s only 'samples' random integers per block are recomputed,
+ *   otherwise the complete block.
+ * - Output: one MISMATCH line per failing integer, and the throughput figures.
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "rl_int.h"
+
+#define LANES      4                          /* 64 bit lanes of a 256 bit vector     */
+#define NLIMB      ((BLEN*INT_LEN+31)/32 + 1)  /* 32 bit limbs, incl. one spare limb   */
+#define TOP_BITS   (BLEN*INT_LEN - 32*(NLIMB-2)) /* bits allowed in the highest limb  */
+#define MAX_STEPS  100000                     /* trajectory length considered hung    */
+
+#define DEFAULT_BLOCKSIZE (((uint32_t)1)<<22) /* keep in line with collatz.c          */
+
+/*
+ *  Work: blocks to check, identified by their base offset
+ */
+typedef struct
+{
+    bigint_t base;        /* the block covers base+2 ... base+blocksize */
+} block_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  more;
+
+    block_t        *q;        /* all unique blocks seen so far          */
+    size_t          qlen, qcap;
+    size_t          next;     /* next block to hand out                 */
+    int             eof;
+
+    uint64_t       *seen;     /* hash set over the base offsets         */
+    size_t          seen_cap;
+
+    uint64_t        checked;  /* integers recomputed                    */
+    uint64_t        blocks;   /* blocks completed                       */
+    uint64_t        mismatch; /* integers that did not verify           */
+} work = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static uint32_t blocksize = DEFAULT_BLOCKSIZE;
+static uint32_t samples   = 0;   /* 0 => complete blocks */
+static int      verbose   = 0;
+
+/**********************************************************/
+/*  bigint_t <-> 32 bit limbs                             */
+/**********************************************************/
+
+static void to_limbs( uint32_t *v, const bigint_t *x )
+{
+    uint64_t acc  = 0;
+    int      bits = 0;
+    int      k    = 0;
+
+    memset( v, 0, NLIMB*sizeof(uint32_t) );
+    for(int i=0; i<x->len; i++)
+    {
+        acc |= ((uint64_t)x->a[i]) << bits;
+        bits += BLEN;
+        while( bits >= 32 )
+        {
+            v[k++] = (uint32_t)acc;
+            acc  >>= 32;
+            bits  -= 32;
+        }
+    }
+    if ( bits )
+        v[k] = (uint32_t)acc;
+}
+
+static void from_limbs( bigint_t *x, const uint32_t *v )
+{
+    uint64_t acc  = 0;
+    int      bits = 0;
+    int      k    = 0;
+
+    x->len = 0;
+    for(int i=0; i<INT_LEN; i++)
+    {
+        while( bits < BLEN && k < NLIMB )
+        {
+            acc |= ((uint64_t)v[k++]) << bits;
+            bits += 32;
+        }
+        x->a[i] = acc & MASK;
+        acc  >>= BLEN;
+        bits  -= BLEN;
+        if ( x->a[i] )
+            x->len = i+1;
+    }
+}
+
+static void add_small( uint32_t *v, uint64_t c )
+{
+    for(int i=0; i<NLIMB && c; i++)
+    {
+        c += v[i];
+        v[i] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+/**********************************************************/
+/*  Trajectory evaluation                                 */
+/**********************************************************/
+
+/*
+ *  Scalar reference: returns 0 if n0 (odd) falls below itself, -1 otherwise
+ */
+static int check_one( const uint32_t *n0 )
+{
+    uint32_t v[NLIMB];
+
+    memcpy( v, n0, sizeof(v) );
+    for(int step=0; step<MAX_STEPS; step++)
+    {
+        uint64_t c = v[0] & 1;   /* odd => v = (3v+1)/2, even => v = v/2 */
+        uint32_t t[NLIMB];
+
+        for(int i=0; i<NLIMB; i++)
+        {
+            uint64_t s = (uint64_t)v[i] + c;
+            if ( v[0] & 1 )
+                s += ((uint64_t)v[i]) << 1;
+            t[i] = (uint32_t)s;
+            c = s >> 32;
+        }
+        if ( c || (t[NLIMB-1] >> 1) || (t[NLIMB-2] >> TOP_BITS) )
+            return -1;   /* rl_int would have overflowed */
+        for(int i=0; i<NLIMB-1; i++)
+            v[i] = (t[i] >> 1) | (t[i+1] << 31);
+        v[NLIMB-1] = t[NLIMB-1] >> 1;
+
+        for(int i=NLIMB-1; i>=0; i--)
+        {
+            if ( v[i] != n0[i] )
+            {
+                if ( v[i] < n0[i] )
+                    return 0;
+                break;
+            }
+        }
+    }
+    return -1;
+}
+
+#if defined(__AVX2__)
+/*
+ *  LANES trajectories at once, one 32 bit limb per 64 bit lane:
+ *  - carries stay within the lane, so 3v+1 is shift+add+mask
+ *  - finished lanes are refilled from the source until it runs dry
+ *  - fail() is called for each lane that did not verify
+ */
+typedef int  (*next_fn)( void *ctx, uint32_t *n0 );
+typedef void (*fail_fn)( void *ctx, const uint32_t *n0 );
+
+static uint64_t check_lanes( void *ctx, next_fn next, fail_fn fail )
+{
+    uint64_t v[NLIMB][LANES]  __attribute__((aligned(32)));
+    uint64_t n0[NLIMB][LANES] __attribute__((aligned(32)));
+    uint32_t steps[LANES];
+    int      live[LANES];
+    int      used = 0;    /* limbs in use, incl. one spare */
+    uint64_t done = 0;
+
+    const __m256i lo32 = _mm256_set1_epi64x( 0xffffffffull );
+    const __m256i one  = _mm256_set1_epi64x( 1 );
+
+    memset( v, 0, sizeof(v) );
+    memset( n0, 0, sizeof(n0) );
+    for(int l=0; l<LANES; l++)
+    {
+        uint32_t x[NLIMB];
+
+        live[l]  = next( ctx, x );
+        steps[l] = 0;
+        for(int i=0; i<NLIMB; i++)
+        {
+            v[i][l] = n0[i][l] = live[l] ? x[i] : 0;
+            if ( live[l] && x[i] && i+2 > used )
+                used = i+2;
+        }
+    }
+
+    while( live[0] | live[1] | live[2] | live[3] )
+    {
+        /* one Terras step: v = (v + (odd ? 2v+1 : 0)) / 2 */
+        __m256i odd   = _mm256_cmpeq_epi64( _mm256_and_si256( _mm256_load_si256( (__m256i *)v[0] ), one ), one );
+        __m256i carry = _mm256_and_si256( odd, one );
+        __m256i prev  = _mm256_setzero_si256();
+        __m256i over  = _mm256_setzero_si256();
+
+        if ( used > NLIMB )
+            used = NLIMB;
+        for(int i=0; i<used; i++)
+        {
+            __m256i x = _mm256_load_si256( (__m256i *)v[i] );
+            __m256i s = _mm256_add_epi64( x, carry );
+            s     = _mm256_add_epi64( s, _mm256_and_si256( _mm256_slli_epi64( x, 1 ), odd ) );
+            carry = _mm256_srli_epi64( s, 32 );
+            s     = _mm256_and_si256( s, lo32 );
+            if ( i >= NLIMB-2 )  /* 3v+1 must fit in 300 bits, as with rl_f3n1 */
+                over = _mm256_or_si256( over, _mm256_srli_epi64( s, i==NLIMB-2 ? TOP_BITS : 0 ) );
+            if ( i )  /* shift the limb pair right by one */
+                _mm256_store_si256( (__m256i *)v[i-1],
+                    _mm256_or_si256( _mm256_srli_epi64( prev, 1 ),
+                                     _mm256_and_si256( _mm256_slli_epi64( s, 31 ), lo32 ) ) );
+            prev = s;
+        }
+        _mm256_store_si256( (__m256i *)v[used-1], _mm256_srli_epi64( prev, 1 ) );
+        over = _mm256_or_si256( over, carry );
+        if ( _mm256_testz_si256( _mm256_load_si256( (__m256i *)v[used-1] ), _mm256_load_si256( (__m256i *)v[used-1] ) ) == 0 )
+            used++;   /* keep one spare zero limb on top */
+
+        /* v < n0 ?  (limbs are < 2^32, so the signed compare is fine) */
+        __m256i lt = _mm256_setzero_si256();
+        __m256i eq = _mm256_cmpeq_epi64( lt, lt );
+        for(int i=(used < NLIMB ? used : NLIMB)-1; i>=0; i--)
+        {
+            __m256i x = _mm256_load_si256( (__m256i *)v[i] );
+            __m256i y = _mm256_load_si256( (__m256i *)n0[i] );
+            lt = _mm256_or_si256( lt, _mm256_and_si256( eq, _mm256_cmpgt_epi64( y, x ) ) );
+            eq = _mm256_and_si256( eq, _mm256_cmpeq_epi64( x, y ) );
+        }
+        int mlt   = _mm256_movemask_pd( _mm256_castsi256_pd( lt ) );
+        int mover = _mm256_movemask_pd( _mm256_castsi256_pd(
+                        _mm256_xor_si256( _mm256_cmpeq_epi64( over, _mm256_setzero_si256() ),
+                                          _mm256_cmpeq_epi64( lo32, lo32 ) ) ) );
+
+        for(int l=0; l<LANES; l++)
+        {
+            int fin = 0;
+
+            if ( !live[l] )
+                continue;
+            steps[l]++;
+            if ( mlt & (1<<l) )
+                fin = 1;
+            else if ( (mover & (1<<l)) || steps[l] >= MAX_STEPS )
+            {
+                uint32_t x[NLIMB];
+
+                for(int i=0; i<NLIMB; i++)
+                    x[i] = (uint32_t)n0[i][l];
+                if ( check_one( x ) )  /* confirm with the scalar reference */
+                    fail( ctx, x );
+                fin = 1;
+            }
+            if ( fin )
+            {
+                uint32_t x[NLIMB];
+
+                done++;
+                live[l]  = next( ctx, x );
+                steps[l] = 0;
+                for(int i=0; i<NLIMB; i++)
+                {
+                    v[i][l] = n0[i][l] = live[l] ? x[i] : 0;
+                    if ( live[l] && x[i] && i+2 > used )
+                        used = i+2;
+                }
+            }
+        }
+    }
+    return done;
+}
+#endif
+
+/**********************************************************/
+/*  Per block iteration                                   */
+/**********************************************************/
+
+typedef struct
+{
+    uint32_t  base[NLIMB];
+    uint32_t  k;          /* integers handed out so far    */
+    uint32_t  count;      /* integers to hand out in total */
+    uint32_t  seed;
+    uint64_t  bad;
+} cursor_t;
+
+static int cursor_next( void *ctx, uint32_t *n0 )
+{
+    cursor_t *c = ctx;
+    uint32_t  j;
+
+    if ( c->k >= c->count )
+        return 0;
+    if ( samples )
+        j = rand_r( &c->seed ) % (blocksize/2);
+    else
+        j = c->k;
+    c->k++;
+    memcpy( n0, c->base, NLIMB*sizeof(uint32_t) );
+    add_small( n0, 2ull*(j+1) );
+    return 1;
+}
+
+static void cursor_fail( void *ctx, const uint32_t *n0 )
+{
+    cursor_t *c = ctx;
+    bigint_t  x;
+
+    from_limbs( &x, n0 );
+    printf( "MISMATCH 0x%s\n", rl_str( &x ) );
+    fflush( stdout );
+    c->bad++;
+}
+
+static void check_block( const block_t *b, unsigned seed )
+{
+    cursor_t c;
+    uint32_t n0[NLIMB];
+
+    memset( &c, 0, sizeof(c) );
+    to_limbs( c.base, &b->base );
+    c.count = samples ? samples : blocksize/2;
+    c.seed  = seed;
+
+#if defined(__AVX2__)
+    check_lanes( &c, cursor_next, cursor_fail );
+#else
+    while( cursor_next( &c, n0 ) )
+        if ( check_one( n0 ) )
+            cursor_fail( &c, n0 );
+#endif
+    (void)n0;
+
+    pthread_mutex_lock( &work.lock );
+    work.checked  += c.count;
+    work.mismatch += c.bad;
+    work.blocks++;
+    if ( verbose )
+    {
+        bigint_t x;
+
+        from_limbs( &x, c.base );
+        printf( "block 0x%s %s\n", rl_str( &x ), c.bad ? "FAILED" : "ok" );
+        fflush( stdout );
+    }
+    pthread_mutex_unlock( &work.lock );
+}
+
+static void *worker( void *arg )
+{
+    unsigned seed = (unsigned)(uintptr_t)arg;
+
+    while( 1 )
+    {
+        block_t b;
+
+        pthread_mutex_lock( &work.lock );
+        while( work.next >= work.qlen && !work.eof )
+            pthread_cond_wait( &work.more, &work.lock );
+        if ( work.next >= work.qlen )
+        {
+            pthread_mutex_unlock( &work.lock );
+            return NULL;
+        }
+        b = work.q[ work.next++ ];
+        pthread_mutex_unlock( &work.lock );
+
+        check_block( &b, seed++ );
+    }
+}
+
+/**********************************************************/
+/*  Log parsing                                           */
+/**********************************************************/
+
+static uint64_t hash_base( const bigint_t *x )
+{
+    uint64_t h = 1469598103934665603ull;  /* FNV-1a */
+
+    for(int i=0; i<x->len; i++)
+    {
+        h ^= x->a[i];
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+/*
+ *  Lock must be held.  Blocks are told apart by the hash of their base only,
+ *  a collision merely skips a duplicate spot-check.
+ */
+static void add_block( const bigint_t *base )
+{
+    uint64_t h = hash_base( base );
+
+    if ( 2*(work.qlen+1) > work.seen_cap )
+    {
+        size_t    cap  = work.seen_cap ? 2*work.seen_cap : 1024;
+        uint64_t *seen = calloc( cap, sizeof(uint64_t) );
+
+        for(size_t i=0; i<work.seen_cap; i++)
+        {
+            if ( !work.seen[i] )
+                continue;
+            size_t j = work.seen[i] & (cap-1);
+            while( seen[j] )
+                j = (j+1) & (cap-1);
+            seen[j] = work.seen[i];
+        }
+        free( work.seen );
+        work.seen     = seen;
+        work.seen_cap = cap;
+    }
+    size_t j = h & (work.seen_cap-1);
+    while( work.seen[j] )
+    {
+        if ( work.seen[j] == h )
+            return;
+        j = (j+1) & (work.seen_cap-1);
+    }
+    work.seen[j] = h;
+
+    if ( work.qlen == work.qcap )
+    {
+        work.qcap = work.qcap ? 2*work.qcap : 256;
+        work.q    = realloc( work.q, work.qcap*sizeof(block_t) );
+    }
+    rl_set( &work.q[ work.qlen++ ].base, base );
+    pthread_cond_signal( &work.more );
+}
+
+/*
+ *  Reads the hex string following "0x" in s, returns -1 if there is none
+ */
+static int parse_frame( bigint_t *x, const char *s )
+{
+    char hex[ MAX_BSTR+3 ] = "0x";
+    int  n = 2;
+
+    s = strstr( s, "0x" );
+    if ( !s )
+        return -1;
+    for(s+=2; isxdigit( (unsigned char)*s ) && n < (int)sizeof(hex)-1; s++)
+        hex[n++] = *s;
+    hex[n] = '\0';
+    return rl_parse( x, hex );
+}
+
+static void parse_line( const char *line )
+{
+    const char *p;
+    bigint_t    frame;
+    int         bid, shifted;
+
+    if ( (p = strstr( line, "Reporting block " )) && sscanf( p, "Reporting block %d", &bid )==1 )
+        shifted = 0;
+    else if ( (p = strstr( line, "Received a report for block " )) && strstr( p, " done" )
+              && sscanf( p, "Received a report for block %d", &bid )==1 )
+        shifted = 0;
+    else if ( (p = strstr( line, "Shifted " )) && sscanf( p, "Shifted %d blocks", &shifted )==1 )
+        bid = 0;
+    else
+        return;
+    if ( bid < 0 || parse_frame( &frame, p ) )
+        return;
+
+    pthread_mutex_lock( &work.lock );
+    if ( shifted )
+    {
+        /* the frame was already raised past the completed blocks */
+        for(int i=0; i<shifted; i++)
+        {
+            bigint_t b;
+            int      ok = 1;
+
+            rl_set( &b, &frame );
+            for(int j=i; j<shifted && ok; j++)
+                ok = !rl_sub( &b, blocksize );
+            if ( ok )
+                add_block( &b );
+        }
+    }
+    else
+    {
+        for(int i=0; i<bid; i++)
+            rl_add( &frame, blocksize );
+        add_block( &frame );
+    }
+    pthread_mutex_unlock( &work.lock );
+}
+
+/**********************************************************/
+
+int main( int argc, char **argv )
+{
+    int       threads = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    FILE     *in      = stdin;
+    char      line[1024];
+    int       opt;
+
+    while( (opt = getopt( argc, argv, "b:s:t:v" )) != -1 )
+    {
+        switch( opt )
+        {
+            case 'b':  blocksize = strtoul( optarg, NULL, 0 );  break;
+            case 's':  samples   = strtoul( optarg, NULL, 0 );  break;
+            case 't':  threads   = atoi( optarg );              break;
+            case 'v':  verbose   = 1;                           break;
+            default:
+                fprintf( stderr, "usage: %s [-b blocksize] [-s samples] [-t threads] [-v] [logfile]\n", argv[0] );
+                return 2;
+        }
+    }
+    if ( blocksize < 2 || (blocksize & 1) || blocksize > MASK || threads < 1 )
+    {
+        fprintf( stderr, "%s: blocksize must be even and <= 2^%d, threads > 0\n", argv[0], BLEN );
+        return 2;
+    }
+    if ( optind < argc && !(in = fopen( argv[optind], "r" )) )
+    {
+        perror( argv[optind] );
+        return 2;
+    }
+
+    struct timespec t0, t1;
+    pthread_t      *tid = calloc( threads, sizeof(pthread_t) );
+
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for(int i=0; i<threads; i++)
+        pthread_create( tid+i, NULL, worker, (void *)(uintptr_t)(0x9e3779b9u*(i+1)) );
+
+    while( fgets( line, sizeof(line), in ) )
+        parse_line( line );
+
+    pthread_mutex_lock( &work.lock );
+    work.eof = 1;
+    pthread_cond_broadcast( &work.more );
+    pthread_mutex_unlock( &work.lock );
+    for(int i=0; i<threads; i++)
+        pthread_join( tid[i], NULL );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+
+    double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)*1e-9;
+    printf( "%llu blocks, %llu integers, %llu mismatches in %.2f s (%.2f M integers/s, %d threads, %s)\n",
+            (unsigned long long)work.blocks, (unsigned long long)work.checked,
+            (unsigned long long)work.mismatch, dt, dt > 0 ? work.checked/dt*1e-6 : 0.0, threads,
+#if defined(__AVX2__)
+            "avx2"
+#else
+            "scalar"
+#endif
+        );
+    return work.mismatch ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+* Host-side benchmark of the outbound path of net_send_down: whole frames
+*  copied onto the queue once per downlink, against pooled refcounted frames.
+*
+* Build (from the project root):
+*   gcc -O2 -Imain -o frame_bench tools/frame_bench.c main/net_wire.c
+*
+* Usage:
+*   frame_bench [-c children] [-f frames] [-l payload] [-k]
+*
+* - Frames are the network layer's own NetFrame, encoded for each destination
+*   with its wire_encode(..) (and so pak_checksum(..)), legacy format unless -k
+*   asks for the compact one.
+* - Copy: what net_send_down did before pooled frames.  For each downlink the
+*   frame is copied into the queue, and the worker copies it out again before
+*   encoding it for that destination.
+* - Pool: one frame is filled once and enqueued as a (frame, destination) pair
+*   per downlink, one reference each.  The worker encodes the shared frame in
+*   place, restores the bytes the compact header overlays and drops its
+*   reference, as outbound_transmit(..) does.
+* - The queue holds OUTBOUND_DATA_SIZE items and is drained by the "worker"
+*   whenever it fills, which stands in for svc_outbound.  No radio time is
+*   counted, so the figures are the cost of the software path alone.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_wire.h"
+
+// As in net_layer.h.
+#define OUTBOUND_DATA_SIZE 16
+#define FRAME_POOL_SIZE 28
+#define APP_HEADER_SIZE 8
+
+typedef struct PoolFrame {
+    NetFrame frame;
+    int refs;
+} PoolFrame;
+
+typedef struct Item {
+    PoolFrame* frame;
+    NodeId destination;
+} Item;
+
+static NetFrame copy_queue[OUTBOUND_DATA_SIZE];
+static NodeId copy_dest[OUTBOUND_DATA_SIZE];
+static Item item_queue[OUTBOUND_DATA_SIZE];
+static int queued;
+
+static PoolFrame pool[FRAME_POOL_SIZE];
+static PoolFrame* pool_free[FRAME_POOL_SIZE];
+static int pool_count;
+
+static uint8_t version = NETWORK_VERSION;
+
+// Bytes moved by memcpy, and wire bytes produced, per path.
+static uint64_t copied;
+static uint64_t encoded;
+
+// Folded into the result so the compiler keeps the work.
+static unsigned sink;
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill(NetFrame* frame, int payload) {
+    memset(frame, 0, sizeof(NetFrame));
+    frame->head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    frame->head.source = 0x16;
+    for (int i = 0; i < APP_HEADER_SIZE + payload; ++i) {
+        frame->contents[i] = (uint8_t)i;
+    }
+    frame->head.reserved[RES_LENGTH] = APP_HEADER_SIZE + payload;
+    copied += APP_HEADER_SIZE + payload;
+}
+
+static void transmit(const uint8_t* wire, int len) {
+    sink += wire[3] + len;
+    encoded += len;
+}
+
+static void copy_drain() {
+    NetFrame out;
+    for (int i = 0; i < queued; ++i) {
+        memcpy(&out, &copy_queue[i], sizeof(NetFrame));
+        copied += sizeof(NetFrame);
+
+        const uint8_t* wire;
+        int len = wire_encode(&out, copy_dest[i], version, &wire);
+        transmit(wire, len);
+    }
+    queued = 0;
+}
+
+static void send_copy(int children, int payload) {
+    NetFrame out;
+    fill(&out, payload);
+
+    for (int i = 0; i < children; ++i) {
+        if (queued == OUTBOUND_DATA_SIZE) {
+            copy_drain();
+        }
+        memcpy(&copy_queue[queued], &out, sizeof(NetFrame));
+        copy_dest[queued++] = (NodeId)(i + 1);
+        copied += sizeof(NetFrame);
+    }
+}
+
+static void pool_release(PoolFrame* frame) {
+    if (--frame->refs == 0) {
+        pool_free[pool_count++] = frame;
+    }
+}
+
+static void pool_drain() {
+    for (int i = 0; i < queued; ++i) {
+        NetFrame* packet = &item_queue[i].frame->frame;
+        uint8_t saved[COMPACT_HEADER_SIZE];
+        memcpy(saved, packet->contents - COMPACT_HEADER_SIZE, COMPACT_HEADER_SIZE);
+
+        const uint8_t* wire;
+        int len = wire_encode(packet, item_queue[i].destination, version, &wire);
+        transmit(wire, len);
+
+        memcpy(packet->contents - COMPACT_HEADER_SIZE, saved, COMPACT_HEADER_SIZE);
+        copied += 2 * COMPACT_HEADER_SIZE;
+        pool_release(item_queue[i].frame);
+    }
+    queued = 0;
+}
+
+static void send_pool(int children, int payload) {
+    if (pool_count == 0) {
+        pool_drain();
+    }
+    PoolFrame* frame = pool_free[--pool_count];
+    frame->refs = 1;
+    fill(&frame->frame, payload);
+
+    for (int i = 0; i < children; ++i) {
+        if (queued == OUTBOUND_DATA_SIZE) {
+            pool_drain();
+        }
+        frame->refs++;
+        item_queue[queued].frame = frame;
+        item_queue[queued].destination = (NodeId)(i + 1);
+        queued++;
+    }
+    pool_release(frame);
+}
+
+static void report(const char* name, int frames, double elapsed) {
+    printf("%s: %.0f frames/s, %.0f ns per frame, %.0f bytes copied and %.0f encoded per frame\n",
+        name, frames / elapsed, 1e9 * elapsed / frames,
+        (double)copied / frames, (double)encoded / frames);
+    copied = 0;
+    encoded = 0;
+}
+
+int main(int argc, char** argv) {
+    int children = 4;
+    int frames = 2000000;
+    int payload = 32;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:f:l:k")) != -1) {
+        switch (opt) {
+        case 'c': children = atoi(optarg); break;
+        case 'f': frames = atoi(optarg); break;
+        case 'l': payload = atoi(optarg); break;
+        case 'k': version = NETWORK_VERSION_COMPACT; break;
+        default:
+            fprintf(stderr, "usage: %s [-c children] [-f frames] [-l payload] [-k]\n", argv[0]);
+            return 2;
+        }
+    }
+    int limit = (version == NETWORK_VERSION ? LEGACY_CONTENTS : FRAME_CONTENTS) - APP_HEADER_SIZE;
+    if (children < 1 || children > 254 || frames < 1 || payload < 0 || payload > limit) {
+        fprintf(stderr, "%s: need 0 < children < 255, frames > 0, payload <= %d\n", argv[0], limit);
+        return 2;
+    }
+
+    for (int i = 0; i < FRAME_POOL_SIZE; ++i) {
+        pool_free[pool_count++] = &pool[i];
+    }
+
+    printf("net_send_down to %d children, %d-byte payload, %s frames, %d frames\n",
+        children, payload, (version == NETWORK_VERSION ? "legacy" : "compact"), frames);
+
+    double t0 = seconds();
+    for (int f = 0; f < frames; ++f) {
+        send_copy(children, payload);
+    }
+    copy_drain();
+    double copy = seconds() - t0;
+    report("copy", frames, copy);
+
+    t0 = seconds();
+    for (int f = 0; f < frames; ++f) {
+        send_pool(children, payload);
+    }
+    pool_drain();
+    double pooled = seconds() - t0;
+    report("pool", frames, pooled);
+
+    printf("speed-up: %.2fx (%u)\n", copy / pooled, sink & 1);
+    return 0;
+}
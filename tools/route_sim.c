@@ -0,0 +1,197 @@
+/*
+* Host-side simulation of unicast routing (net_send_to) against flooding
+*  (net_send_down) on a random network tree.
+*
+* Build (from the project root):
+*   gcc -O2 -o route_sim tools/route_sim.c
+*
+* Usage:
+*   route_sim [-n nodes] [-f fan-out] [-m messages] [-r reports] [-s seed]
+*
+* - The tree is grown the way nodes join: each new node links to a random
+*   node which still has a free down-stream slot.
+* - Every node first sends 'reports' messages up-stream; each ancestor learns
+*   the route to the origin, as route_learn(..) does.  With -r 0 no routes are
+*   known and every unicast falls back to flooding.
+* - Then 'messages' unicasts go from random sources to random targets, hop by
+*   hop with the rules of route_forward(..), and the same deliveries are made
+*   by sending up to the root and flooding down, which is what applications
+*   had to do before.  One transmission is counted per frame per link.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_NODES 255
+
+typedef struct SimNode {
+    int parent;                 // -1 for the root.
+    int children[MAX_NODES];
+    int child_count;
+    int depth;
+    int via[MAX_NODES];         // Learned route: child towards node, -1 if unknown.
+} SimNode;
+
+static SimNode nodes[MAX_NODES];
+static int node_count = 40;
+static int fan_out = 4;
+
+static long tx_count;
+static int delivered;
+
+static void build_tree() {
+    nodes[0].parent = -1;
+    for (int i = 1; i < node_count; ++i) {
+        int p;
+        do {
+            p = rand() % i;
+        } while (nodes[p].child_count >= fan_out);
+
+        nodes[i].parent = p;
+        nodes[i].depth = nodes[p].depth + 1;
+        nodes[p].children[nodes[p].child_count++] = i;
+    }
+    for (int i = 0; i < node_count; ++i) {
+        for (int j = 0; j < node_count; ++j) {
+            nodes[i].via[j] = -1;
+        }
+    }
+}
+
+/*
+* An up-stream message from 'origin' teaches every ancestor its route.
+*/
+static void send_report(int origin) {
+    int hop = origin;
+    while (nodes[hop].parent >= 0) {
+        tx_count++;
+        nodes[nodes[hop].parent].via[origin] = hop;
+        hop = nodes[hop].parent;
+    }
+}
+
+/*
+* The whole subtree below 'at' receives one copy per link.
+*/
+static void flood(int at, int target) {
+    if (at == target) {
+        delivered++;
+    }
+    for (int i = 0; i < nodes[at].child_count; ++i) {
+        tx_count++;
+        flood(nodes[at].children[i], target);
+    }
+}
+
+/*
+* Mirrors route_forward(..): 'src' is the node the frame came from, -1 if it
+*  originates at 'at'.
+*/
+static void route(int at, int src, int target) {
+    if (at == target && src >= 0) {
+        delivered++;
+        return;
+    }
+
+    int via = nodes[at].via[target];
+    int from_up = (src >= 0 && src == nodes[at].parent);
+    if (via >= 0 && via != src) {
+        tx_count++;
+        route(via, at, target);
+    }
+    else if (!from_up && nodes[at].parent >= 0) {
+        tx_count++;
+        route(nodes[at].parent, at, target);
+    }
+    else {
+        for (int i = 0; i < nodes[at].child_count; ++i) {
+            tx_count++;
+            route(nodes[at].children[i], at, target);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int messages = 1000;
+    int reports = 1;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:f:m:r:s:")) != -1) {
+        switch (opt) {
+        case 'n': node_count = atoi(optarg); break;
+        case 'f': fan_out = atoi(optarg); break;
+        case 'm': messages = atoi(optarg); break;
+        case 'r': reports = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nodes] [-f fan-out] [-m messages] [-r reports] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (node_count < 2 || node_count > MAX_NODES || fan_out < 1 || messages < 1 || reports < 0) {
+        fprintf(stderr, "%s: need 2 <= nodes <= %d, fan-out > 0, messages > 0\n", argv[0], MAX_NODES);
+        return 2;
+    }
+
+    srand(seed);
+    build_tree();
+
+    int max_depth = 0;
+    for (int i = 0; i < node_count; ++i) {
+        if (nodes[i].depth > max_depth) {
+            max_depth = nodes[i].depth;
+        }
+    }
+    printf("tree: %d nodes, fan-out %d, depth %d\n", node_count, fan_out, max_depth);
+
+    tx_count = 0;
+    for (int r = 0; r < reports; ++r) {
+        for (int i = 1; i < node_count; ++i) {
+            send_report(i);
+        }
+    }
+    printf("learning: %ld transmissions (%d reports per node)\n", tx_count, reports);
+
+    int* src = malloc(messages * sizeof(int));
+    int* dst = malloc(messages * sizeof(int));
+    for (int m = 0; m < messages; ++m) {
+        src[m] = rand() % node_count;
+        do {
+            dst[m] = rand() % node_count;
+        } while (dst[m] == src[m]);
+    }
+
+    tx_count = 0;
+    delivered = 0;
+    for (int m = 0; m < messages; ++m) {
+        int hop = src[m];
+        while (nodes[hop].parent >= 0) {
+            tx_count++;
+            hop = nodes[hop].parent;
+        }
+        if (dst[m] == 0) {
+            delivered++;
+        }
+        else {
+            flood(0, dst[m]);
+        }
+    }
+    long flooded = tx_count;
+    printf("up + flood: %ld transmissions, %.1f per message, %d delivered\n",
+        flooded, (double)flooded / messages, delivered);
+
+    tx_count = 0;
+    delivered = 0;
+    for (int m = 0; m < messages; ++m) {
+        route(src[m], -1, dst[m]);
+    }
+    printf("net_send_to: %ld transmissions, %.1f per message, %d delivered\n",
+        tx_count, (double)tx_count / messages, delivered);
+    printf("reduction: %.1f%%\n", 100.0 * (flooded - tx_count) / flooded);
+
+    free(src);
+    free(dst);
+    return 0;
+}
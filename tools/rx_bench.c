@@ -0,0 +1,191 @@
+/*
+* Host-side benchmark of the receive path, from the ESP-NOW callback to the
+*  application: the packet copied into the receive ring, decoded into a frame
+*  and copied again into an application buffer, against one copy into a
+*  receive buffer which is decoded in place and lent to the application.
+*
+* Build (from the project root):
+*   gcc -O2 -Imain -o rx_bench tools/rx_bench.c main/net_wire.c
+*
+* Usage:
+*   rx_bench [-f frames] [-l payload] [-k]
+*
+* - Frames are built with the network layer's own wire_encode(..), legacy
+*   format unless -k asks for the compact one, and carry one application
+*   message of 'payload' bytes.
+* - Copy: what espnow_recv and net_dispatch did before.  The packet is copied
+*   into a ring slot, wire_decode(..) copies it into the static frame, and
+*   deliver_app copies the message into a pooled application buffer.
+* - Lend: espnow_recv copies the packet once, to wire_place(..) in a pooled
+*   receive buffer, wire_open(..) decodes it there, and the application gets
+*   a pointer into it plus a reference.
+* - Both end with the "application" reading the payload and releasing it; no
+*   queue or task switch is counted, only the copying and decoding.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_wire.h"
+
+// As in net_layer.h and network.h.
+#define RX_BUFFER_COUNT 24
+#define NET_MAX_PAYLOAD 234
+#define APP_HEADER_SIZE 8
+
+typedef struct RxSlot {
+    uint8_t mac[6];
+    uint8_t len;
+    int8_t rssi;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} RxSlot;
+
+typedef struct AppBuffer {
+    uint8_t head[APP_HEADER_SIZE];
+    uint8_t data[NET_MAX_PAYLOAD];
+} __attribute__((aligned(4))) AppBuffer;
+
+typedef struct RxBuffer {
+    NetFrame frame;
+    uint32_t refs;
+    uint8_t mac[6];
+    uint8_t len;
+    uint8_t format;
+} __attribute__((aligned(4))) RxBuffer;
+
+static RxSlot ring[16];
+static NetFrame in;
+static AppBuffer app_buffers[RX_BUFFER_COUNT];
+static RxBuffer rx_buffers[RX_BUFFER_COUNT];
+
+// Copies made and bytes copied, per path.
+static uint64_t copies;
+static uint64_t copied;
+
+// Folded into the result so the compiler keeps the work.
+static unsigned sink;
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void count(int bytes) {
+    copies++;
+    copied += bytes;
+}
+
+static void consume(const uint8_t* payload, int len) {
+    sink += payload[0] + payload[len - 1];
+}
+
+static void recv_copy(const uint8_t* mac, const uint8_t* wire, int len, int f) {
+    RxSlot* slot = &ring[f % 16];
+    memcpy(slot->mac, mac, 6);
+    memcpy(slot->data, wire, len);
+    slot->len = len;
+    count(len);
+
+    if (!wire_decode(slot->data, slot->len, &in)) {
+        return;
+    }
+    count(slot->len);
+
+    AppBuffer* buffer = &app_buffers[f % RX_BUFFER_COUNT];
+    int size = APP_HEADER_SIZE + in.contents[2];
+    memcpy(buffer, in.contents, size);
+    count(size);
+
+    consume(buffer->data, in.contents[2]);
+}
+
+static void recv_lend(const uint8_t* mac, const uint8_t* wire, int len, int f) {
+    RxBuffer* rx = &rx_buffers[f % RX_BUFFER_COUNT];
+    rx->refs = 1;
+    memcpy(wire_place(&rx->frame, wire[0]), wire, len);
+    memcpy(rx->mac, mac, 6);
+    rx->len = len;
+    rx->format = wire[0];
+    count(len);
+
+    if (!wire_open(&rx->frame, rx->len, rx->format)) {
+        return;
+    }
+
+    // Lent to the application, which releases it when done.
+    rx->refs++;
+    const uint8_t* msg = rx->frame.contents;
+    consume(msg + APP_HEADER_SIZE, msg[2]);
+    rx->refs -= 2;
+}
+
+static void report(const char* name, int frames, double elapsed) {
+    printf("%s: %.0f ns per frame, %.1f copies and %.0f bytes copied per frame\n",
+        name, 1e9 * elapsed / frames, (double)copies / frames, (double)copied / frames);
+    copies = 0;
+    copied = 0;
+}
+
+int main(int argc, char** argv) {
+    int frames = 2000000;
+    int payload = 32;
+    uint8_t version = NETWORK_VERSION;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:l:k")) != -1) {
+        switch (opt) {
+        case 'f': frames = atoi(optarg); break;
+        case 'l': payload = atoi(optarg); break;
+        case 'k': version = NETWORK_VERSION_COMPACT; break;
+        default:
+            fprintf(stderr, "usage: %s [-f frames] [-l payload] [-k]\n", argv[0]);
+            return 2;
+        }
+    }
+    int limit = (version == NETWORK_VERSION ? LEGACY_CONTENTS : FRAME_CONTENTS) - APP_HEADER_SIZE;
+    if (frames < 1 || payload < 1 || payload > limit) {
+        fprintf(stderr, "%s: need frames > 0, 0 < payload <= %d\n", argv[0], limit);
+        return 2;
+    }
+
+    NetFrame out;
+    memset(&out, 0, sizeof(NetFrame));
+    out.head.version = (NETWORK_TYPE | NETWORK_VERSION);
+    out.head.source = 0x20;
+    out.contents[0] = 9;
+    out.contents[2] = (uint8_t)payload;
+    for (int i = 0; i < payload; ++i) {
+        out.contents[APP_HEADER_SIZE + i] = (uint8_t)i;
+    }
+    out.head.reserved[RES_LENGTH] = APP_HEADER_SIZE + payload;
+
+    uint8_t wire[ESP_NOW_MAX_DATA_LEN];
+    const uint8_t* encoded;
+    int len = wire_encode(&out, 0x10, version, &encoded);
+    memcpy(wire, encoded, len);
+    static const uint8_t mac[6] = { 0x24, 0x0a, 0xc4, 0, 0, 0x20 };
+
+    printf("receive, %d-byte payload, %s frames of %d bytes, %d frames\n",
+        payload, (version == NETWORK_VERSION ? "legacy" : "compact"), len, frames);
+
+    double t0 = seconds();
+    for (int f = 0; f < frames; ++f) {
+        recv_copy(mac, wire, len, f);
+    }
+    double copy = seconds() - t0;
+    report("copy", frames, copy);
+
+    t0 = seconds();
+    for (int f = 0; f < frames; ++f) {
+        recv_lend(mac, wire, len, f);
+    }
+    double lend = seconds() - t0;
+    report("lend", frames, lend);
+
+    printf("speed-up: %.2fx (%u)\n", copy / lend, sink & 1);
+    return 0;
+}